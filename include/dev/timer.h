@@ -3,9 +3,13 @@
 
 #include "types.h"
 
+#define TIMER_FREQ 10000000 /* read_time() per second on qemu virt */
+
 void timer_init(void);
 void timer_intr(void);
 void timer_set_next(void);
+void timer_idle(void);
 int timer_sleep(uint64_t n);
+int timer_nanosleep(uint64_t ns);
 
 #endif
@@ -6,9 +6,10 @@
 #include "lock.h"
 
 struct m_inode {
-	uint32_t dev;	 /* Device number */
-	uint16_t ino;	 /* Inode number */
-	uint32_t refcnt; /* Reference count */
+	uint32_t dev;	       /* Device number */
+	uint16_t ino;	       /* Inode number */
+	uint32_t refcnt;       /* Reference count */
+	struct m_inode *next; /* In its hash chain of the inode table */
 
 	struct sleep_lock lock;
 
@@ -40,6 +41,7 @@ void stati(struct m_inode *inode, struct stat *st);
 off_t lseeki(struct m_inode *inode, off_t offset);
 struct m_inode *namei(char *path);
 struct m_inode *parenti(char *path, char *name);
+uint16_t dir_find(struct m_inode *dir, char *name, size_t *poff);
 struct m_inode *dir_lookup(struct m_inode *dir, char *name, size_t *poff);
 int dir_link(struct m_inode *dir, char *name, uint32_t ino);
 
@@ -3,6 +3,7 @@
 
 #include "fs/file.h"
 
+void pipe_init(void);
 int pipe_alloc(struct file **rfile, struct file **wfile);
 void pipe_close(struct pipe *pi, bool writable);
 ssize_t pipe_read(struct pipe *pi, uint64_t dst, size_t n);
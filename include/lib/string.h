@@ -6,6 +6,8 @@
 void *memset(void *ptr, int v, size_t n);
 void *memmove(void *dst, const void *src, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
+void page_zero(void *page);
+void page_copy(void *dst, const void *src);
 
 size_t strlen(const char *s);
 int strncmp(const char *s1, const char *s2, size_t n);
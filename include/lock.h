@@ -1,24 +1,38 @@
 #ifndef _LOCK_H
 #define _LOCK_H
 
+#include "sched/wait.h"
 #include "types.h"
 
+/*
+ * A ticket lock: harts take the lock in the order they asked for it,
+ * and spin reading owner until it reaches their ticket.  The lock is
+ * free when owner has caught up with next.
+ */
 struct spin_lock {
-	bool locked;
+	uint32_t next;	/* Ticket of the next hart to ask */
+	uint32_t owner; /* Ticket of the hart holding the lock */
 	int cpuid;
 	const char *name;
+#ifdef LOCK_STAT
+	struct lock_stat *stat; /* Shared by the locks of the same name */
+	uint64_t acquired_at;	/* read_time() when it was taken */
+#endif
 };
 
 void spin_lock_init(struct spin_lock *lock, const char *name);
 void spin_lock_acquire(struct spin_lock *lock);
+bool spin_lock_try(struct spin_lock *lock);
 void spin_lock_release(struct spin_lock *lock);
 bool spin_lock_holding(struct spin_lock *lock);
+void lock_stat_dump(void);
 
 struct sleep_lock {
 	struct spin_lock lock;
 	bool locked;
 	pid_t pid;
 	const char *name;
+	struct wait_queue waiters;
 };
 
 void sleep_lock_init(struct sleep_lock *lock, const char *name);
@@ -36,14 +36,31 @@
 
 #define TRAMPOLINE (MAX_VADDR - PAGE_SIZE)
 
-#define KERNEL_STACK(p) (TRAMPOLINE - ((p) + 1) * 2 * PAGE_SIZE)
+/*
+ * Each kernel stack lies above an unmapped guard of its own size, in a
+ * slot aligned to twice that size, so an sp that overflowed into the
+ * guard has bit KERNEL_STACK_SHIFT clear.  The top slot holds the
+ * trampoline.
+ */
+#define KERNEL_STACK_SHIFT 14
+#define KERNEL_STACK_SIZE (1ul << KERNEL_STACK_SHIFT)
+#define KERNEL_STACK(p) \
+	(MAX_VADDR - ((p) + 2) * 2 * KERNEL_STACK_SIZE + KERNEL_STACK_SIZE)
+#define KERNEL_STACK_LOW (KERNEL_STACK(N_PROC - 1) - KERNEL_STACK_SIZE)
 
 #define TRAP_FRAME (TRAMPOLINE - PAGE_SIZE)
 
-#define USER_STACK_SIZE PAGE_SIZE
+/* The user stack is populated on faults, down to USER_STACK_BASE. */
+#define USER_STACK_SIZE (USER_STACK_PAGES * PAGE_SIZE)
 #define USER_STACK_TOP (TRAP_FRAME - PAGE_SIZE)
 #define USER_STACK_BASE (USER_STACK_TOP - USER_STACK_SIZE)
 
+/* A stack overflowing into the guard region faults. */
+#define USER_GUARD_BASE (USER_STACK_BASE - USER_GUARD_PAGES * PAGE_SIZE)
+
+/* mmap() places mappings downwards from here, above the heap. */
+#define USER_MMAP_TOP USER_GUARD_BASE
+
 /*
  *   User Space Memory Layout
  *
@@ -53,11 +70,14 @@
  *         trap frame
  * --------------------------- MAX_VADDR - 2 * PAGE_SIZE
  *       protected pages
- * --------------------------- MAX_VADDR - 3 * PAGE_SIZE
+ * --------------------------- USER_STACK_TOP
  * //////// user stack ///////
- * --------------------------- MAX_VADDR - 4 * PAGE_SIZE
- *       protected pages
- * --------------------------- MAX_VADDR - 5 * PAGE_SIZE
+ *    grows down on faults
+ * --------------------------- USER_STACK_BASE
+ *        guard region
+ * --------------------------- USER_GUARD_BASE = USER_MMAP_TOP
+ * ///// mmap() regions //////
+ * ///////////////////////////
  *            ...
  *            ...
  * --------------------------- p->size
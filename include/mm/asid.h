@@ -0,0 +1,13 @@
+#ifndef _ASID_H
+#define _ASID_H
+
+#include "types.h"
+
+struct process;
+
+void asid_init(void);
+uint64_t asid_satp(struct process *p);
+void asid_release(struct process *p);
+void asid_flush_page(struct process *p, uint64_t va);
+
+#endif
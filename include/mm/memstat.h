@@ -0,0 +1,14 @@
+#ifndef _MEMSTAT_H
+#define _MEMSTAT_H
+
+#include "types.h"
+
+/* Memory usage, see memstat(). */
+struct memstat {
+	uint64_t total;	 /* Pages managed by the page allocator */
+	uint64_t free;	 /* Pages not allocated */
+	uint64_t rss;	 /* User pages mapped by the process */
+	uint64_t kstack; /* Most bytes of kernel stack the process used */
+};
+
+#endif
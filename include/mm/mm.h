@@ -7,18 +7,49 @@ struct process;
 
 typedef uint64_t pte_t;
 
+/* Free pages kept by each hart in front of the buddy allocator. */
+#define PM_CACHE_SIZE 32
+/* Pages moved between a hart's cache and the buddy allocator at once. */
+#define PM_CACHE_BATCH (PM_CACHE_SIZE / 2)
+
+struct pm_cache {
+	int count;
+	void *pages[PM_CACHE_SIZE];
+
+	/* statistics */
+	uint64_t alloc_hits;   /* pm_alloc() served from the cache */
+	uint64_t alloc_misses; /* pm_alloc() found the cache empty */
+	uint64_t free_hits;    /* pm_free() kept the page in the cache */
+	uint64_t free_misses;  /* pm_free() found the cache full */
+	uint64_t refills;      /* batches taken from the buddy allocator */
+	uint64_t drains;       /* batches given back to the buddy allocator */
+};
+
 void pm_init(void);
 void *pm_alloc(void);
 void *pm_zalloc(void);
+bool pm_zero_idle(void);
 void pm_free(void *ptr);
+void pm_dup(void *ptr);
+uint32_t pm_refcnt(void *ptr);
+void *pm_alloc_pages(int order);
+void pm_free_pages(void *ptr, int order);
+void pm_stat(uint64_t *total, uint64_t *free);
+void pm_dump(void);
 
 void kvm_init(void);
 void kvm_init_hart(void);
+int kvm_map_stack(uint64_t va);
+size_t kvm_unmap_stack(uint64_t va);
 
 pte_t *walk(pte_t *page_table, uint64_t va, bool alloc);
+pte_t *walk_span(pte_t *page_table, uint64_t va, uint64_t end, bool alloc,
+		 size_t *n);
 int map_pages(pte_t *page_table, uint64_t va, uint64_t pa, size_t size,
 	      uint64_t perm);
 void unmap_pages(pte_t *page_table, uint64_t va, size_t size, bool free);
+void uvm_unmap(pte_t *page_table, uint64_t va, size_t size);
+int uvm_copy(pte_t *dst, pte_t *src, uint64_t start, uint64_t end, bool cow);
 
 uint64_t uvm_alloc(pte_t *page_table, uint64_t old_sz, uint64_t new_sz,
 		   uint64_t xperm);
@@ -29,6 +60,8 @@ uint64_t uvm_walk_addr(pte_t *page_table, uint64_t va);
 pte_t *get_user_page_table(struct process *p);
 void free_user_page_table(pte_t *page_table, size_t size);
 int copy_user_page_table(pte_t *dst, pte_t *src, size_t size);
+int uvm_fault(struct process *p, uint64_t va, uint64_t access);
+int uvm_prefault(uint64_t va, size_t n, bool write);
 
 int copy_in(pte_t *page_table, void *dst, uint64_t src, size_t n);
 int copy_out(pte_t *page_table, uint64_t dst, void *src, size_t n);
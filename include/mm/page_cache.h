@@ -0,0 +1,18 @@
+#ifndef _PAGE_CACHE_H
+#define _PAGE_CACHE_H
+
+#include "types.h"
+
+struct m_inode;
+
+void page_cache_init(void);
+void *page_cache_lookup(struct m_inode *inode, uint32_t off, uint32_t len);
+void *page_cache_insert(struct m_inode *inode, uint32_t off, uint32_t len,
+			void *page);
+void page_cache_write(struct m_inode *inode, uint32_t off, const void *src,
+		      uint32_t n);
+void page_cache_invalidate(struct m_inode *inode, uint32_t off,
+			   uint32_t len);
+void page_cache_dump(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SHRINKER_H
+#define _SHRINKER_H
+
+#include "types.h"
+
+/*
+ * A cache that can give pages back when pm_alloc() runs out.  shrink()
+ * frees up to nr pages that only the cache holds, without sleeping,
+ * and returns how many it freed.  It may run wherever pm_alloc() is
+ * called, so it must not take locks held around pm_alloc().
+ */
+struct shrinker {
+	const char *name;
+	size_t (*shrink)(size_t nr);
+	struct shrinker *next;
+	uint64_t reclaimed; /* Pages freed so far */
+};
+
+void shrinker_register(struct shrinker *s);
+size_t pm_reclaim(size_t nr);
+
+#endif
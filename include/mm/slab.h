@@ -0,0 +1,41 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "lock.h"
+#include "param.h"
+
+struct slab;
+
+/* Free objects kept by each hart in front of the slabs. */
+#define SLAB_CPU_SIZE 8
+
+struct slab_cpu {
+	int count;
+	void *objs[SLAB_CPU_SIZE];
+};
+
+/* A cache of objects of one size, carved out of single pages. */
+struct slab_cache {
+	const char *name;
+	size_t size;		 /* Object size, rounded up to 8 bytes */
+	uint32_t per_slab;	 /* Objects in one page */
+	void (*ctor)(void *obj); /* Run once on each new object, or NULL */
+	struct spin_lock lock;
+	struct slab *partial; /* Slabs with free objects */
+	struct slab *full;    /* Slabs without */
+	struct slab_cpu cpu[N_CPU];
+	struct slab_cache *next; /* In the list of all caches */
+
+	/* statistics */
+	uint64_t slabs;	 /* Pages held */
+	uint64_t in_use; /* Objects held by users */
+};
+
+void slab_cache_init(struct slab_cache *c, const char *name, size_t size,
+		     void (*ctor)(void *obj));
+void *slab_alloc(struct slab_cache *c);
+void slab_free(struct slab_cache *c, void *obj);
+size_t slab_shrink(struct slab_cache *c);
+void slab_dump(void);
+
+#endif
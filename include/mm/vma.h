@@ -0,0 +1,33 @@
+#ifndef _VMA_H
+#define _VMA_H
+
+#include "mm/mm.h"
+
+struct m_inode;
+struct file;
+
+#define VMA_SHARED (1 << 0) /* Stores reach the file, MAP_SHARED */
+
+/* A range of user memory that is populated on page faults. */
+struct vma {
+	uint64_t start;	       /* First address, page aligned */
+	uint64_t end;	       /* End address, page aligned, 0 if unused */
+	struct m_inode *inode; /* Backing file, NULL if anonymous */
+	uint32_t off;	       /* File offset of start */
+	uint32_t file_size;    /* Bytes backed by the file, the rest is zero */
+	uint32_t perm;	       /* PTE_R, PTE_W and PTE_X */
+	uint32_t flags;	       /* VMA_SHARED */
+};
+
+struct vma *vma_alloc(struct vma *vmas);
+struct vma *vma_find(struct vma *vmas, uint64_t va);
+bool vma_overlap(struct vma *vmas, uint64_t start, uint64_t end);
+void vma_dup(struct vma *dst, struct vma *src);
+int vma_copy(pte_t *dst, pte_t *src, struct vma *vmas, uint64_t size);
+void vma_clear(pte_t *page_table, struct vma *vmas);
+int vma_fault(pte_t *page_table, struct vma *v, uint64_t va, bool write);
+uint64_t mmap(struct process *p, uint64_t len, int prot, int flags,
+	      struct file *f, uint32_t off);
+int munmap(struct process *p, uint64_t addr, uint64_t len);
+
+#endif
@@ -2,17 +2,20 @@
 #define _PARAM_H
 
 #define N_CPU 3
-#define N_PROC 64
+#define N_PROC 1024 /* kernel stack slots, the most processes at once */
 #define ROOT_DEV 1
 #define N_OFILE 16
-#define N_FILE 100
+#define N_VMA 16
 #define N_DEV 10
-#define N_INODE 50
+#define N_PCACHE 256 /* cached pages before unmapped ones are evicted */
 #define MAX_OP_BLKS 10
 #define N_BUF (MAX_OP_BLKS * 3)
+#define N_BUF_MAX (N_BUF * 16) /* the most the buffer cache grows to */
 #define LOG_SIZE (MAX_OP_BLKS * 3)
 #define MAX_PATH 128
 #define MAX_ARGS 32
 #define MAX_ENVS 16
+#define USER_STACK_PAGES 256 /* the most a user stack grows to */
+#define USER_GUARD_PAGES 16 /* never mapped, below the user stack */
 
 #endif
@@ -45,6 +45,10 @@ static inline uint64_t read_satp(void)
 #define SATP_SV39 (8ul << 60)
 #define MAKE_SATP(page_table) (SATP_SV39 | (((uint64_t)(page_table)) >> 12))
 
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_BITS 16
+#define SATP_ASID_MASK ((1ul << SATP_ASID_BITS) - 1)
+
 static inline void write_satp(uint64_t v)
 {
 	asm volatile("csrw satp, %0" : : "r"(v));
@@ -55,6 +59,18 @@ static inline void sfence_vma(void)
 	asm volatile("sfence.vma zero, zero");
 }
 
+/* Flush the non-global entries of one address space. */
+static inline void sfence_vma_asid(uint64_t asid)
+{
+	asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory");
+}
+
+/* Flush one page of one address space. */
+static inline void sfence_vma_page(uint64_t va, uint64_t asid)
+{
+	asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(asid) : "memory");
+}
+
 static inline uint64_t read_stvec(void)
 {
 	uint64_t v;
@@ -109,6 +125,19 @@ static inline void write_sie(uint64_t v)
 	asm volatile("csrw sie, %0" : : "r"(v));
 }
 
+/* Supervisor Interrupt Pending, same bits as sie */
+static inline uint64_t read_sip(void)
+{
+	uint64_t v;
+	asm volatile("csrr %0, sip" : "=r"(v));
+	return v;
+}
+
+static inline void write_sip(uint64_t v)
+{
+	asm volatile("csrw sip, %0" : : "r"(v));
+}
+
 static inline void intr_on(void)
 {
 	write_sstatus(read_sstatus() | SSTATUS_SIE);
@@ -125,6 +154,16 @@ static inline bool intr_get(void)
 	return (v & SSTATUS_SIE) != 0;
 }
 
+#define SCOUNTEREN_CY (1 << 0) /* cycle */
+#define SCOUNTEREN_TM (1 << 1) /* time */
+#define SCOUNTEREN_IR (1 << 2) /* instret */
+
+/* Counters user mode may read */
+static inline void write_scounteren(uint64_t v)
+{
+	asm volatile("csrw scounteren, %0" : : "r"(v));
+}
+
 static inline uint64_t read_time(void)
 {
 	uint64_t v;
@@ -144,10 +183,14 @@ static inline uint64_t read_time(void)
 #define PXSHIFT(level) (PAGE_SHIFT + (9 * (level)))
 #define PX(va, level) ((((uint64_t)(va)) >> PXSHIFT(level)) & PXMASK)
 
+/* Bytes mapped by a leaf PTE at level: 4 KiB, 2 MiB or 1 GiB */
+#define LEVEL_SIZE(level) (1ul << PXSHIFT(level))
+
 #define PTE2PA(pte) (((pte) >> 10) << 12)
 #define PA2PTE(pa) (((uint64_t)(pa) >> 12) << 10)
 
 #define PTE_FLAGS(pte) ((pte) & 0x3fful)
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
 
 #define PTE_V (1ul << 0) /* Valid */
 #define PTE_R (1ul << 1) /* Read */
@@ -158,4 +201,8 @@ static inline uint64_t read_time(void)
 #define PTE_A (1ul << 6) /* Accessed */
 #define PTE_D (1ul << 7) /* Dirty */
 
+/* Bits 8 and 9 are reserved for software. */
+#define PTE_COW (1ul << 8)   /* Copy-on-write */
+#define PTE_DIRTY (1ul << 9) /* Shared file page written by the process */
+
 #endif
@@ -0,0 +1,52 @@
+#ifndef _SBI_H
+#define _SBI_H
+
+#include "types.h"
+
+#define SBI_SET_TIMER 0x0 /* Legacy extension */
+#define SBI_IPI_EXTENSION 0x735049 /* "sPI" in hex */
+#define SBI_IPI_SEND 0x0
+#define SBI_RFENCE_EXTENSION 0x52464e43 /* "RFNC" in hex */
+#define SBI_RFENCE_SFENCE_VMA 0x1
+
+/* Raise a timer interrupt on this hart at read_time() == when. */
+static inline void sbi_set_timer(uint64_t when)
+{
+	register uint64_t a0 asm("a0") = when;
+	register uint64_t a7 asm("a7") = SBI_SET_TIMER;
+
+	asm volatile("ecall" : "+r"(a0) : "r"(a7) : "a1", "memory");
+}
+
+/* Raise a software interrupt on the harts in mask. */
+static inline void sbi_send_ipi(uint64_t mask)
+{
+	register uint64_t a0 asm("a0") = mask;
+	register uint64_t a1 asm("a1") = 0; /* mask base */
+	register uint64_t a6 asm("a6") = SBI_IPI_SEND;
+	register uint64_t a7 asm("a7") = SBI_IPI_EXTENSION;
+
+	asm volatile("ecall"
+		     : "+r"(a0), "+r"(a1)
+		     : "r"(a6), "r"(a7)
+		     : "memory");
+}
+
+/* Flush [start, start + size) from the TLBs of the harts in mask. */
+static inline void sbi_remote_sfence_vma(uint64_t mask, uint64_t start,
+					 uint64_t size)
+{
+	register uint64_t a0 asm("a0") = mask;
+	register uint64_t a1 asm("a1") = 0; /* mask base */
+	register uint64_t a2 asm("a2") = start;
+	register uint64_t a3 asm("a3") = size;
+	register uint64_t a6 asm("a6") = SBI_RFENCE_SFENCE_VMA;
+	register uint64_t a7 asm("a7") = SBI_RFENCE_EXTENSION;
+
+	asm volatile("ecall"
+		     : "+r"(a0), "+r"(a1)
+		     : "r"(a2), "r"(a3), "r"(a6), "r"(a7)
+		     : "memory");
+}
+
+#endif
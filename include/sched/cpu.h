@@ -3,6 +3,22 @@
 
 #include "sched/proc.h"
 
+struct rq_list {
+	struct process *head;
+	struct process *tail;
+};
+
+/* Runnable processes waiting for a cpu, see sched_classes in proc.c */
+struct run_queue {
+	struct spin_lock lock;
+	int nr; /* Processes queued */
+	/* SCHED_FIXED processes, by priority */
+	struct rq_list fixed[PRIO_FIXED_MAX + 1];
+	/* SCHED_FAIR processes, by virtual runtime */
+	struct rq_list fair;
+	int64_t min_vruntime;
+};
+
 struct cpu {
 	/* The process running on this cpu, or NULL */
 	struct process *proc;
@@ -12,11 +28,27 @@ struct cpu {
 	int n_off;
 	/* Were interrupts enabled before push_off()? */
 	bool intr_ena;
+	/* Free pages private to this cpu, see pm_alloc() */
+	struct pm_cache pm_cache;
+	/* ASID generation whose entries the TLB may hold, see asid.c */
+	uint64_t asid_generation;
+	/* Processes to run on this cpu */
+	struct run_queue rq;
+	/* A queued process outranks the running one */
+	bool resched;
+	/* Waiting in wfi for an interrupt, see cpu_kick() */
+	bool idle;
+	/* Processes taken from other run queues */
+	uint64_t steals;
+	/* Processes run here that last ran on another cpu */
+	uint64_t migrations;
 };
 
 struct cpu *current_cpu(void);
+struct cpu *cpu_get(int id);
 int current_cpuid(void);
 struct process *running_proc(void);
+bool need_resched(void);
 void push_off(void);
 void pop_off(void);
 
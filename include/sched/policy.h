@@ -0,0 +1,12 @@
+#ifndef _POLICY_H
+#define _POLICY_H
+
+/* Scheduling policies, see setpriority(). */
+#define SCHED_FAIR 0  /* Share the cpu by nice value */
+#define SCHED_FIXED 1 /* Run before SCHED_FAIR, by priority */
+
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+#define PRIO_FIXED_MAX 7
+
+#endif
@@ -3,7 +3,9 @@
 
 #include "lock.h"
 #include "mm/mm.h"
+#include "mm/vma.h"
 #include "param.h"
+#include "sched/policy.h"
 
 struct trap_frame {
 	/*   0 */ uint64_t kernel_satp;	  /* Kernel page table */
@@ -76,21 +78,56 @@ struct file;
 
 struct process {
 	struct spin_lock lock;
+	struct process *all_next; /* In the list of all, set once */
 
 	/* p->lock must be held when using these: */
-	int state;   /* Process state */
-	void *chan;  /* If not NULL, sleeping on chan */
-	bool killed; /* If true, have been killed */
-	int xstate;  /* Exit state to be returned to parent's wait */
-	pid_t pid;   /* Process ID */
+	int state;	    /* Process state */
+	bool killed;	    /* If true, have been killed */
+	int xstate;	    /* Exit state to be returned to parent's wait */
+	pid_t pid;	    /* Process ID */
+	int cpu;	    /* Cpu it last ran on, whose run queue it joins */
+	int policy;	    /* SCHED_FAIR or SCHED_FIXED */
+	int nice;	    /* Weight in the fair class */
+	int prio;	    /* Priority in the fixed class */
+	int64_t vruntime;   /* Weighted time run in the fair class */
+	uint64_t run_start; /* When it was last switched in */
+	uint64_t queued_at; /* When it was last queued */
+	bool kstack_mapped; /* Pages are behind kernel_stack */
+
+	/* The run queue lock must be held when using these: */
+	struct process *rq_next; /* Next in the run queue */
+
+	/* The lock of the wait queue must be held when using these: */
+	struct wait_queue *wait;   /* If not NULL, sleeping on wait */
+	struct process *wait_next; /* Neighbours in the wait queue */
+	struct process *wait_prev;
 
 	/* wait_lock must be held when using these: */
-	struct process *parent; /* Parent process */
+	struct process *parent;		/* Parent process */
+	struct wait_queue child_exit;	/* wait() sleeps here */
+
+	/*
+	 * Written by the process, or by the scheduler while it is switched
+	 * out; others read them unlocked.  In read_time() units.
+	 */
+	uint64_t mark;	 /* Start of the current user or kernel period */
+	uint64_t utime;	 /* Time run in user mode */
+	uint64_t stime;	 /* Time run in the kernel */
+	uint64_t wtime;	 /* Time waited on a run queue */
+	uint64_t nvcsw;	 /* Switches to sleep */
+	uint64_t nivcsw; /* Switches while still runnable */
+	uint64_t cutime; /* Totals of the children waited for */
+	uint64_t cstime;
+	uint64_t cwtime;
 
 	/* These are private fields */
 	uint64_t kernel_stack;	     /* Virtual address of kernel stack */
 	uint64_t size;		     /* Size of process memory */
+	uint64_t rss;		     /* User pages mapped */
 	pte_t *page_table;	     /* User page table */
+	uint64_t asid;		     /* Generation and ASID, see asid.c */
+	uint64_t tlb_stale;	     /* Harts whose TLB may be stale */
+	struct vma vmas[N_VMA];	     /* Ranges populated on page faults */
 	struct trap_frame *tf;	     /* Data page for trampoline.S */
 	struct context ctx;	     /* context_switch() here to run process */
 	struct file *ofile[N_OFILE]; /* Open files */
@@ -111,9 +148,10 @@ void set_killed(struct process *p);
 void yield(void);
 pid_t fork(void);
 int kill(pid_t pid);
+int memstat(pid_t pid, uint64_t addr);
+int setpriority(pid_t pid, int policy, int value);
+int getrusage(pid_t pid, uint64_t addr);
 int wait(uint64_t state);
 void do_exit(int state);
-void sleep_on(void *chan, struct spin_lock *lock);
-void wake_up(void *chan);
 
 #endif
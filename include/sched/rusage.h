@@ -0,0 +1,18 @@
+#ifndef _RUSAGE_H
+#define _RUSAGE_H
+
+#include "types.h"
+
+/* Cpu time and switches of a process, see getrusage(). */
+struct rusage {
+	uint64_t utime;	 /* Microseconds run in user mode */
+	uint64_t stime;	 /* Microseconds run in the kernel */
+	uint64_t wtime;	 /* Microseconds runnable but waiting for a cpu */
+	uint64_t nvcsw;	 /* Voluntary switches, to sleep */
+	uint64_t nivcsw; /* Involuntary switches, by preemption */
+	uint64_t cutime; /* Totals of the children waited for */
+	uint64_t cstime;
+	uint64_t cwtime;
+};
+
+#endif
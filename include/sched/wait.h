@@ -0,0 +1,24 @@
+#ifndef _WAIT_H
+#define _WAIT_H
+
+#include "types.h"
+
+struct process;
+struct spin_lock;
+
+/*
+ * Processes sleeping until a condition changes, oldest first.  The
+ * queue is protected by the spin lock that guards the condition: it
+ * is passed to sleep_on() and must be held around wake_up().
+ */
+struct wait_queue {
+	struct process *head;
+	struct process *tail;
+};
+
+void wait_queue_init(struct wait_queue *wq);
+void sleep_on(struct wait_queue *wq, struct spin_lock *lock);
+void wake_up(struct wait_queue *wq);
+void wake_up_one(struct wait_queue *wq);
+
+#endif
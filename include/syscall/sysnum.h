@@ -26,5 +26,11 @@
 #define SYS_shutdown 23
 #define SYS_lseek 24
 #define SYS_dup2 25
+#define SYS_mmap 26
+#define SYS_munmap 27
+#define SYS_memstat 28
+#define SYS_setpriority 29
+#define SYS_nanosleep 30
+#define SYS_getrusage 31
 
 #endif
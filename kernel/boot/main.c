@@ -4,7 +4,10 @@
 #include "fs/buf.h"
 #include "fs/file.h"
 #include "fs/inode.h"
+#include "fs/pipe.h"
+#include "mm/asid.h"
 #include "mm/mm.h"
+#include "mm/page_cache.h"
 #include "printk.h"
 #include "sched/cpu.h"
 #include "sched/proc.h"
@@ -57,6 +60,7 @@ void main(void)
 		pm_init();
 		kvm_init();
 		kvm_init_hart();
+		asid_init();
 		proc_init();
 		trap_init();
 		trap_init_hart();
@@ -64,7 +68,9 @@ void main(void)
 		plic_init_hart();
 		binit();
 		iinit();
+		page_cache_init();
 		file_init();
+		pipe_init();
 		virtio_disk_init();
 		user_init();
 		__sync_synchronize();
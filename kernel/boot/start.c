@@ -10,5 +10,6 @@ void start(uint64_t hartid, uint64_t dbt_entry)
 	write_satp(0);
 	write_tp(hartid);
 	write_sie(read_sie() | SIE_SEIE | SIE_SSIE | SIE_STIE);
+	write_scounteren(SCOUNTEREN_CY | SCOUNTEREN_TM | SCOUNTEREN_IR);
 	main();
 }
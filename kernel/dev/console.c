@@ -2,6 +2,9 @@
 #include "dev/uart.h"
 #include "fs/file.h"
 #include "lock.h"
+#include "mm/mm.h"
+#include "mm/page_cache.h"
+#include "mm/slab.h"
 #include "param.h"
 #include "sched/cpu.h"
 
@@ -15,6 +18,7 @@ struct console {
 	uint32_t r;
 	uint32_t w;
 	uint32_t e;
+	struct wait_queue readers; /* console_read() waits for a line */
 };
 
 extern struct device devlist[N_DEV];
@@ -23,6 +27,7 @@ static struct console cons;
 void console_init(void)
 {
 	spin_lock_init(&cons.lock, "console");
+	wait_queue_init(&cons.readers);
 	uart_init();
 	devlist[CONSOLE].read = console_read;
 	devlist[CONSOLE].write = console_write;
@@ -52,6 +57,10 @@ void console_intr(int c)
 	switch (c) {
 	case C('P'):
 		proc_dump();
+		pm_dump();
+		page_cache_dump();
+		slab_dump();
+		lock_stat_dump();
 		break;
 	case '\x7f': /* Delete key */
 		if (cons.e != cons.w) {
@@ -68,7 +77,7 @@ void console_intr(int c)
 			if (c == '\n' || c == C('D') ||
 			    ((cons.e + 1) % INPUT_SIZE) == cons.r) {
 				cons.w = cons.e;
-				wake_up(&cons.r);
+				wake_up(&cons.readers);
 			}
 		}
 		break;
@@ -83,6 +92,9 @@ ssize_t console_read(bool to_user, uint64_t dst, size_t n)
 	char cbuf;
 
 	target = n;
+	/* Copying must not fault under cons.lock. */
+	if (to_user && uvm_prefault(dst, n, true))
+		return -1;
 
 	spin_lock_acquire(&cons.lock);
 	while (n > 0) {
@@ -91,7 +103,7 @@ ssize_t console_read(bool to_user, uint64_t dst, size_t n)
 				spin_lock_release(&cons.lock);
 				return -1;
 			}
-			sleep_on(&cons.r, &cons.lock);
+			sleep_on(&cons.readers, &cons.lock);
 		}
 
 		c = cons.buf[cons.r];
@@ -120,6 +132,8 @@ ssize_t console_write(bool from_user, uint64_t src, size_t n)
 	size_t i;
 	char c;
 
+	if (from_user && uvm_prefault(src, n, false))
+		return -1;
 	spin_lock_acquire(&cons.lock);
 	for (i = 0; i < n; i++) {
 		if (either_copy_in(from_user, &c, src, sizeof(char)) != 0)
@@ -1,56 +1,151 @@
 #include "dev/timer.h"
 #include "lock.h"
 #include "riscv.h"
+#include "sbi.h"
 #include "sched/cpu.h"
 
-#define INTERVAL 1000000
+#define INTERVAL 1000000 /* Time slice of a running process */
+#define NEVER (~0ul)
 
-struct timer {
-	uint64_t ticks;
+/* A process sleeping until deadline. */
+struct timer_event {
+	uint64_t deadline;
+	bool queued;
+	struct timer_event *next;
+	struct wait_queue wait;
+};
+
+/*
+ * The timer of a hart.  There is no periodic tick: the timer is
+ * programmed for the next deadline, and for the end of the time slice
+ * while the hart runs a process.
+ */
+struct timer_base {
 	struct spin_lock lock;
+	struct timer_event *events; /* Sorted by deadline */
+	uint64_t armed;		    /* Programmed, only used by its hart */
 };
 
-static struct timer sys_timer;
+static struct timer_base bases[N_CPU];
 
 void timer_init(void)
 {
-	sys_timer.ticks = 0;
-	spin_lock_init(&sys_timer.lock, "timer");
+	int i;
+
+	for (i = 0; i < N_CPU; i++) {
+		spin_lock_init(&bases[i].lock, "timer");
+		bases[i].events = NULL;
+		bases[i].armed = NEVER;
+	}
+}
+
+/* Interrupts must be off, so this stays on the hart of b. */
+static void timer_program(struct timer_base *b, uint64_t when)
+{
+	if (when == b->armed)
+		return;
+	b->armed = when;
+	sbi_set_timer(when);
+}
+
+static uint64_t next_deadline(struct timer_base *b)
+{
+	return b->events ? b->events->deadline : NEVER;
 }
 
 void timer_intr(void)
 {
-	if (current_cpuid() == 0) {
-		spin_lock_acquire(&sys_timer.lock);
-		sys_timer.ticks++;
-		spin_lock_release(&sys_timer.lock);
-		wake_up(&sys_timer.ticks);
+	struct timer_base *b = &bases[current_cpuid()];
+	struct timer_event *ev;
+	uint64_t now, next;
+
+	spin_lock_acquire(&b->lock);
+	now = read_time();
+	while ((ev = b->events) && ev->deadline <= now) {
+		b->events = ev->next;
+		ev->queued = false;
+		wake_up(&ev->wait);
 	}
-	timer_set_next();
+	next = next_deadline(b);
+	/* scheduler() stops the time slice if the hart goes idle. */
+	b->armed = NEVER;
+	timer_program(b, next < now + INTERVAL ? next : now + INTERVAL);
+	spin_lock_release(&b->lock);
 }
 
-/* Set the next timer interrupt. */
+/* Start the time slice of a process, see scheduler(). */
 void timer_set_next(void)
 {
-	uint64_t next = read_time() + INTERVAL;
-	asm volatile("li a7, 0");
-	asm volatile("mv a0, %0" : : "r"(next));
-	asm volatile("ecall");
+	struct timer_base *b;
+	uint64_t slice;
+
+	push_off();
+	b = &bases[current_cpuid()];
+	slice = read_time() + INTERVAL;
+	if (b->armed > slice)
+		timer_program(b, slice);
+	pop_off();
 }
 
-/* Sleep n ticks on the timer. */
-int timer_sleep(uint64_t n)
+/* Leave only the next deadline programmed while the hart idles. */
+void timer_idle(void)
+{
+	struct timer_base *b;
+
+	push_off();
+	b = &bases[current_cpuid()];
+	spin_lock_acquire(&b->lock);
+	timer_program(b, next_deadline(b));
+	spin_lock_release(&b->lock);
+	pop_off();
+}
+
+static int timer_sleep_until(uint64_t deadline)
 {
-	uint64_t ticks;
-	spin_lock_acquire(&sys_timer.lock);
-	ticks = sys_timer.ticks;
-	while (sys_timer.ticks - ticks < n) {
+	struct timer_base *b;
+	struct timer_event ev, **pp;
+	int ret = 0;
+
+	/* The lock keeps interrupts off, so this stays on the hart of b. */
+	push_off();
+	b = &bases[current_cpuid()];
+	spin_lock_acquire(&b->lock);
+	pop_off();
+
+	ev.deadline = deadline;
+	ev.queued = true;
+	wait_queue_init(&ev.wait);
+	for (pp = &b->events; *pp; pp = &(*pp)->next) {
+		if (deadline < (*pp)->deadline)
+			break;
+	}
+	ev.next = *pp;
+	*pp = &ev;
+	if (deadline < b->armed)
+		timer_program(b, deadline);
+
+	while (ev.queued) {
 		if (killed(running_proc())) {
-			spin_lock_release(&sys_timer.lock);
-			return -1;
+			for (pp = &b->events; *pp != &ev; pp = &(*pp)->next)
+				;
+			*pp = ev.next;
+			ret = -1;
+			break;
 		}
-		sleep_on(&sys_timer.ticks, &sys_timer.lock);
+		sleep_on(&ev.wait, &b->lock);
 	}
-	spin_lock_release(&sys_timer.lock);
-	return 0;
+	spin_lock_release(&b->lock);
+	return ret;
+}
+
+/* Sleep n time slices. */
+int timer_sleep(uint64_t n)
+{
+	return timer_sleep_until(read_time() + n * INTERVAL);
+}
+
+/* Sleep ns nanoseconds, to the resolution of read_time(). */
+int timer_nanosleep(uint64_t ns)
+{
+	return timer_sleep_until(read_time() + ns / (1000000000 / TIMER_FREQ));
 }
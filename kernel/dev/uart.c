@@ -36,6 +36,7 @@ struct uart_tx {
 	uint32_t w;
 #define UART_TX_BUF_SIZE 32
 	char buf[UART_TX_BUF_SIZE];
+	struct wait_queue space; /* uart_putc() waits for room in buf */
 };
 
 extern bool panicked;
@@ -61,7 +62,7 @@ static void uart_start(void)
 		tx.r = (tx.r + 1) % UART_TX_BUF_SIZE;
 
 		/* maybe uart_putc() is waiting for space in the buffer. */
-		wake_up(&tx.r);
+		wake_up(&tx.space);
 
 		WRITE_REG(THR, c);
 	}
@@ -92,6 +93,7 @@ void uart_init(void)
 	WRITE_REG(IER, LSR_RX_READY | LSR_TX_IDLE);
 
 	spin_lock_init(&tx.lock, "uart");
+	wait_queue_init(&tx.space);
 }
 
 void uart_putc_sync(int c)
@@ -123,7 +125,7 @@ void uart_putc(int c)
 	 * wait for uart_start() to open up space in the buffer.
 	 */
 	while ((tx.w + 1) % UART_TX_BUF_SIZE == tx.r)
-		sleep_on(&tx.r, &tx.lock);
+		sleep_on(&tx.space, &tx.lock);
 
 	tx.buf[tx.w] = c;
 	tx.w = (tx.w + 1) % UART_TX_BUF_SIZE;
@@ -2,6 +2,7 @@
 #include "lib/string.h"
 #include "lock.h"
 #include "memlayout.h"
+#include "mm/mm.h"
 #include "printk.h"
 #include "riscv.h"
 #include "sched/proc.h"
@@ -126,12 +127,14 @@ struct virtio_blk_req {
 #define READ_REG(r) (*(REG(r)))
 #define WRITE_REG(r, v) (*(REG(r)) = (v))
 
+/* virtqueue memory is 2^VIRTQ_ORDER contiguous pages. */
+#define VIRTQ_ORDER 1
+
 struct virtio_disk {
 	/* memory for virtio descriptors &c for queue 0.
-	 * this is a global instead of allocated because it must
-	 * be multiple contiguous pages, which pm_alloc()
-	 * doesn't support, and page aligned. */
-	uint8_t virtq_mem[2 * PAGE_SIZE];
+	 * it must be multiple contiguous pages and page aligned,
+	 * so it comes from pm_alloc_pages(). */
+	uint8_t *virtq_mem;
 
 	/* a set (not a ring) of DMA descriptors, with which the
 	 * driver tells the device where to read and write individual
@@ -152,6 +155,7 @@ struct virtio_disk {
 	struct virtq_used *used;
 
 	bool free[NUM];	   /* is descriptor free? */
+	struct wait_queue free_wait; /* waiting for free descriptors */
 	uint16_t used_idx; /* we've looked this far in used[2..NUM]. */
 
 	/* track info about in-flight operations,
@@ -160,6 +164,7 @@ struct virtio_disk {
 	struct virtio_disk_track_info {
 		struct buffer *b;
 		char status;
+		struct wait_queue done; /* waiting for completion */
 	} info[NUM];
 
 	/* disk command headers.
@@ -167,7 +172,7 @@ struct virtio_disk {
 	struct virtio_blk_req ops[NUM];
 
 	struct spin_lock lock;
-} __attribute__((aligned(PAGE_SIZE)));
+};
 
 static struct virtio_disk disk;
 
@@ -175,8 +180,12 @@ void virtio_disk_init(void)
 {
 	uint32_t status, max_q_size;
 	uint64_t features;
+	int i;
 
 	spin_lock_init(&disk.lock, "virtio_disk");
+	wait_queue_init(&disk.free_wait);
+	for (i = 0; i < NUM; i++)
+		wait_queue_init(&disk.info[i].done);
 
 	if (READ_REG(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
 	    READ_REG(VIRTIO_MMIO_VERSION) != 1 ||
@@ -233,11 +242,14 @@ void virtio_disk_init(void)
 		panic("virtio disk max queue too short");
 
 	/* allocate and zero queue memory. */
+	disk.virtq_mem = pm_alloc_pages(VIRTQ_ORDER);
+	if (!disk.virtq_mem)
+		panic("virtio disk queue memory");
 	disk.desc = (struct virtq_desc *)(disk.virtq_mem);
 	disk.avail = (struct virtq_avail *)(disk.virtq_mem +
 					    NUM * sizeof(struct virtq_desc));
 	disk.used = (struct virtq_used *)(disk.virtq_mem + PAGE_SIZE);
-	memset(disk.virtq_mem, 0, sizeof(disk.virtq_mem));
+	memset(disk.virtq_mem, 0, PAGE_SIZE << VIRTQ_ORDER);
 
 	/* set queue size */
 	WRITE_REG(VIRTIO_MMIO_QUEUE_NUM, NUM);
@@ -281,7 +293,6 @@ static void free_desc(int i)
 	disk.desc[i].flags = 0;
 	disk.desc[i].next = 0;
 	disk.free[i] = true;
-	wake_up(&disk.free[0]);
 }
 
 /* free a chain of descriptors. */
@@ -297,6 +308,8 @@ static void free_chain(int i)
 		else
 			break;
 	}
+	/* A chain is what one virtio_disk_rw() needs. */
+	wake_up_one(&disk.free_wait);
 }
 
 /*
@@ -335,7 +348,7 @@ static void virtio_disk_rw(struct buffer *b, bool is_write)
 	while (true) {
 		if (alloc3_desc(idx) == 0)
 			break;
-		sleep_on(&disk.free[0], &disk.lock);
+		sleep_on(&disk.free_wait, &disk.lock);
 	}
 
 	req = &disk.ops[idx[0]];
@@ -381,7 +394,7 @@ static void virtio_disk_rw(struct buffer *b, bool is_write)
 	WRITE_REG(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
 
 	while (b->disk)
-		sleep_on(b, &disk.lock);
+		sleep_on(&disk.info[idx[0]].done, &disk.lock);
 
 	disk.info[idx[0]].b = NULL;
 	free_chain(idx[0]);
@@ -410,7 +423,7 @@ void virtio_disk_intr(void)
 
 		b = disk.info[id].b;
 		b->disk = false;
-		wake_up(b);
+		wake_up(&disk.info[id].done);
 
 		disk.used_idx += 1;
 	}
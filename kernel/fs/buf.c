@@ -1,12 +1,20 @@
 #include "fs/buf.h"
 #include "dev/virtio_disk.h"
 #include "lock.h"
+#include "mm/shrinker.h"
+#include "mm/slab.h"
 #include "param.h"
 #include "printk.h"
 
+/*
+ * N_BUF buffers are always there.  Beyond them the cache grows up to
+ * N_BUF_MAX buffers from a slab cache, which its shrinker gives back.
+ */
 struct buffer_cache {
 	struct spin_lock lock;
 	struct buffer buf[N_BUF];
+	struct slab_cache cache; /* The buffers beyond buf */
+	uint32_t count;		 /* Buffers in the list or being added */
 
 	/*
 	 * Linked list of all buffers, through prev/next.
@@ -21,11 +29,42 @@ static struct buffer_cache bcache;
 #define FIRST_BUF (&bcache.buf[0])
 #define LAST_BUF (&bcache.buf[N_BUF - 1])
 
+static size_t bcache_shrink(size_t nr);
+
+static struct shrinker bcache_shrinker = {
+	.name = "bcache",
+	.shrink = bcache_shrink,
+};
+
+static void buf_ctor(void *obj)
+{
+	struct buffer *b = obj;
+	sleep_lock_init(&b->lock, "buf");
+}
+
+/* Put b at the head of the list, as the most recently used. */
+static void buf_link_head(struct buffer *b)
+{
+	b->next = bcache.head.next;
+	b->prev = &bcache.head;
+	bcache.head.next->prev = b;
+	bcache.head.next = b;
+}
+
+static void buf_unlink(struct buffer *b)
+{
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+}
+
 void binit(void)
 {
 	struct buffer *b;
 
 	spin_lock_init(&bcache.lock, "bcache");
+	/* Clean buffers are the first thing to reclaim. */
+	shrinker_register(&bcache_shrinker);
+	slab_cache_init(&bcache.cache, "buf", sizeof(struct buffer), buf_ctor);
 	/* Create linked list of buffers. */
 	bcache.head.prev = &bcache.head;
 	bcache.head.next = &bcache.head;
@@ -33,49 +72,82 @@ void binit(void)
 		sleep_lock_init(&b->lock, "buf");
 		b->refcnt = 0;
 		b->valid = false;
-		b->next = bcache.head.next;
-		b->prev = &bcache.head;
-		bcache.head.next->prev = b;
-		bcache.head.next = b;
+		buf_link_head(b);
+	}
+	bcache.count = N_BUF;
+}
+
+/* Look for a cached block.  Must be called with bcache.lock held. */
+static struct buffer *buf_lookup(uint32_t dev, uint32_t bno)
+{
+	struct buffer *b;
+
+	for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+		if (b->dev == dev && b->bno == bno)
+			return b;
 	}
+	return NULL;
 }
 
 /* Return a locked buffer with the contents of the indicated block. */
 struct buffer *bread(uint32_t dev, uint32_t bno)
 {
-	struct buffer *b;
+	struct buffer *b, *nb = NULL;
 
 	spin_lock_acquire(&bcache.lock);
 
 	/* Is the block already cached? */
-	for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-		if (b->dev == dev && b->bno == bno) {
-			b->refcnt++;
-			spin_lock_release(&bcache.lock);
-			sleep_lock_acquire(&b->lock);
-			return b;
-		}
+	if ((b = buf_lookup(dev, bno))) {
+		b->refcnt++;
+		spin_lock_release(&bcache.lock);
+		sleep_lock_acquire(&b->lock);
+		return b;
 	}
 
 	/*
-	 * Not cached.
-	 * Recycle the least recently used (LRU) unused buffer.
+	 * Not cached.  Grow the cache if it may, allocating without the
+	 * lock, which reclaim may take, and look again afterwards.  The
+	 * slot is taken before the lock is dropped, so that concurrent
+	 * misses cannot grow the cache past N_BUF_MAX.
 	 */
-	for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-		if (b->refcnt == 0) {
-			b->dev = dev;
-			b->bno = bno;
-			b->valid = false;
-			b->refcnt = 1;
+	if (bcache.count < N_BUF_MAX) {
+		bcache.count++;
+		spin_lock_release(&bcache.lock);
+		nb = slab_alloc(&bcache.cache);
+		spin_lock_acquire(&bcache.lock);
+		if ((b = buf_lookup(dev, bno))) {
+			b->refcnt++;
+			bcache.count--;
 			spin_lock_release(&bcache.lock);
+			if (nb)
+				slab_free(&bcache.cache, nb);
 			sleep_lock_acquire(&b->lock);
-			virtio_disk_read(b);
-			b->valid = true;
 			return b;
 		}
+		if (!nb)
+			bcache.count--;
 	}
-
-	panic("no buffers");
+	if (nb) {
+		b = nb;
+		buf_link_head(b);
+	} else {
+		/* Recycle the least recently used (LRU) unused buffer. */
+		for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+			if (b->refcnt == 0)
+				break;
+		}
+		if (b == &bcache.head)
+			panic("no buffers");
+	}
+	b->dev = dev;
+	b->bno = bno;
+	b->valid = false;
+	b->refcnt = 1;
+	spin_lock_release(&bcache.lock);
+	sleep_lock_acquire(&b->lock);
+	virtio_disk_read(b);
+	b->valid = true;
+	return b;
 }
 
 /*
@@ -100,12 +172,8 @@ void brelse(struct buffer *b)
 	b->refcnt--;
 	if (b->refcnt == 0) {
 		/* No one is waiting for it. */
-		b->next->prev = b->prev;
-		b->prev->next = b->next;
-		b->next = bcache.head.next;
-		b->prev = &bcache.head;
-		bcache.head.next->prev = b;
-		bcache.head.next = b;
+		buf_unlink(b);
+		buf_link_head(b);
 	}
 	spin_lock_release(&bcache.lock);
 }
@@ -127,3 +195,38 @@ void bunpin(struct buffer *b)
 	b->refcnt--;
 	spin_lock_release(&bcache.lock);
 }
+
+/*
+ * Free up to nr pages of buffers beyond the first N_BUF, least recently
+ * used first.  A buffer nobody references is clean: the log pins the
+ * buffers it has yet to write.
+ */
+static size_t bcache_shrink(size_t nr)
+{
+	struct buffer *b, *prev, *freed = NULL;
+	size_t n = nr * bcache.cache.per_slab;
+
+	spin_lock_acquire(&bcache.lock);
+	for (b = bcache.head.prev; b != &bcache.head && n > 0; b = prev) {
+		prev = b->prev;
+		if (b->refcnt != 0 || (b >= FIRST_BUF && b <= LAST_BUF))
+			continue;
+		buf_unlink(b);
+		bcache.count--;
+		b->next = freed;
+		freed = b;
+		n--;
+	}
+	spin_lock_release(&bcache.lock);
+
+	/* Free them after dropping bcache.lock, which stays a leaf lock. */
+	while ((b = freed)) {
+		freed = b->next;
+		slab_free(&bcache.cache, b);
+	}
+	/*
+	 * This also empties the object cache of this hart, which a
+	 * slab_alloc() that got us here may be about to refill.
+	 */
+	return slab_shrink(&bcache.cache);
+}
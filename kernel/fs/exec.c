@@ -3,6 +3,7 @@
 #include "fs/log.h"
 #include "lib/string.h"
 #include "memlayout.h"
+#include "mm/asid.h"
 #include "mm/mm.h"
 #include "printk.h"
 #include "riscv.h"
@@ -18,23 +19,27 @@ static int flags2perm(int flags)
 	return perm;
 }
 
-static int load_seg(pte_t *page_table, uint64_t va, struct m_inode *inode,
-		    size_t off, size_t sz)
+/*
+ * Push len bytes of src onto the stack of the new image, populating
+ * the stack pages below *low as they are reached.
+ */
+static int stack_push(pte_t *page_table, uint64_t *sp, uint64_t *low,
+		      void *src, size_t len)
 {
-	size_t i, n;
-	uint64_t pa;
-
-	for (i = 0; i < sz; i += PAGE_SIZE) {
-		pa = uvm_walk_addr(page_table, va + i);
-		if (!pa)
-			panic("the address does not exist when loading segment");
-		if (sz - i < PAGE_SIZE)
-			n = sz - i;
-		else
-			n = PAGE_SIZE;
-		if (readi(inode, false, pa, off + i, n) != n)
+	uint64_t a;
+
+	if (*sp - USER_STACK_BASE < len)
+		return -1;
+	a = *sp - len;
+	a -= a % 16;
+	if (a < *low) {
+		if (!uvm_alloc(page_table, PAGE_ROUND_DOWN(a), *low, PTE_W))
 			return -1;
+		*low = PAGE_ROUND_DOWN(a);
 	}
+	if (copy_out(page_table, a, src, len))
+		return -1;
+	*sp = a;
 	return 0;
 }
 
@@ -45,18 +50,19 @@ int do_execve(char *path, char **argv, char **env)
 	pte_t *new_page_table, *old_page_table;
 	uint64_t new_sz, old_sz;
 	uint64_t uargc, uargv[MAX_ARGS], uenv[MAX_ENVS];
-	uint64_t sp;
+	uint64_t sp, low;
 	uint16_t i;
 	uint64_t off;
 	size_t len;
-	uint64_t ret;
 	struct m_inode *inode;
 	struct process *p;
+	struct vma vmas[N_VMA], *v;
 	char *name;
 
 	p = running_proc();
 	new_page_table = NULL;
 	new_sz = 0;
+	memset(vmas, 0, sizeof(vmas));
 
 	begin_op();
 
@@ -86,16 +92,23 @@ int do_execve(char *path, char **argv, char **env)
 			goto bad;
 		if (ph.vaddr + ph.memsz < ph.vaddr)
 			goto bad;
-		if (ph.vaddr % PAGE_SIZE != 0)
+		if (ph.vaddr % PAGE_SIZE != 0 || ph.off % PAGE_SIZE != 0)
 			goto bad;
-		if (!(ret = uvm_alloc(new_page_table, new_sz,
-				      ph.vaddr + ph.memsz,
-				      flags2perm(ph.flags))))
+		if (ph.vaddr + ph.memsz > USER_MMAP_TOP)
 			goto bad;
-		new_sz = ret;
-		if (load_seg(new_page_table, ph.vaddr, inode, ph.off,
-			     ph.filesz))
+		if (ph.memsz == 0)
+			continue;
+		/* The segment is read from the file on first touch. */
+		if (!(v = vma_alloc(vmas)))
 			goto bad;
+		v->start = ph.vaddr;
+		v->end = PAGE_ROUND_UP(ph.vaddr + ph.memsz);
+		v->inode = idup(inode);
+		v->off = ph.off;
+		v->file_size = ph.filesz;
+		v->perm = PTE_R | flags2perm(ph.flags);
+		if (ph.vaddr + ph.memsz > new_sz)
+			new_sz = ph.vaddr + ph.memsz;
 	}
 
 	iunlock(inode);
@@ -103,27 +116,19 @@ int do_execve(char *path, char **argv, char **env)
 	end_op();
 	inode = NULL;
 
-	/* copy 'argv' strings */
-	sp = USER_STACK_TOP;
+	/* copy 'argv' strings, the stack grows as far as they need */
+	sp = low = USER_STACK_TOP;
 	for (uargc = 0; argv[uargc]; uargc++) {
 		if (uargc >= MAX_ARGS)
 			goto bad;
 		len = strlen(argv[uargc]) + 1;
-		sp -= len;
-		sp -= sp % 16;
-		if (sp < USER_STACK_BASE)
-			goto bad;
-		if (copy_out(new_page_table, sp, argv[uargc], len))
+		if (stack_push(new_page_table, &sp, &low, argv[uargc], len))
 			goto bad;
 		uargv[uargc] = sp;
 	}
 	uargv[uargc] = 0;
 	len = (uargc + 1) * sizeof(uint64_t);
-	sp -= len;
-	sp -= sp % 16;
-	if (sp < USER_STACK_BASE)
-		goto bad;
-	if (copy_out(new_page_table, sp, uargv, len))
+	if (stack_push(new_page_table, &sp, &low, uargv, len))
 		goto bad;
 	p->tf->a1 = sp;
 
@@ -132,21 +137,13 @@ int do_execve(char *path, char **argv, char **env)
 		if (i >= MAX_ENVS)
 			goto bad;
 		len = strlen(env[i]) + 1;
-		sp -= len;
-		sp -= sp % 16;
-		if (sp < USER_STACK_BASE)
-			goto bad;
-		if (copy_out(new_page_table, sp, env[i], len))
+		if (stack_push(new_page_table, &sp, &low, env[i], len))
 			goto bad;
 		uenv[i] = sp;
 	}
 	uenv[i] = 0;
 	len = (i + 1) * sizeof(uint64_t);
-	sp -= len;
-	sp -= sp % 16;
-	if (sp < USER_STACK_BASE)
-		goto bad;
-	if (copy_out(new_page_table, sp, uenv, len))
+	if (stack_push(new_page_table, &sp, &low, uenv, len))
 		goto bad;
 	p->tf->a2 = sp;
 
@@ -162,19 +159,27 @@ int do_execve(char *path, char **argv, char **env)
 	old_sz = p->size;
 	p->page_table = new_page_table;
 	p->size = new_sz;
+	/* Only the stack is mapped, the segments are read on faults. */
+	p->rss = (USER_STACK_TOP - low) / PAGE_SIZE;
 	p->tf->epc = elf.entry;
 	p->tf->sp = sp;
+	/* The TLB may still hold entries of the old page table. */
+	asid_release(p);
+	vma_clear(old_page_table, p->vmas);
 	free_user_page_table(old_page_table, old_sz);
+	memmove(p->vmas, vmas, sizeof(vmas));
 
 	return uargc;
 
 bad:
-	if (new_page_table)
-		free_user_page_table(new_page_table, new_sz);
 	if (inode) {
 		iunlock(inode);
 		iput(inode);
 		end_op();
 	}
+	if (new_page_table) {
+		vma_clear(new_page_table, vmas);
+		free_user_page_table(new_page_table, new_sz);
+	}
 	return -1;
 }
@@ -7,39 +7,35 @@
 #include "lib/string.h"
 #include "lock.h"
 #include "mm/mm.h"
+#include "mm/slab.h"
 #include "param.h"
 #include "printk.h"
 #include "sched/cpu.h"
 
+/* Open files come from a slab cache, so there is no fixed limit. */
 struct file_table {
-	struct file files[N_FILE];
-	struct spin_lock lock;
+	struct slab_cache cache;
+	struct spin_lock lock; /* Protects refcnt of every file */
 };
 
 struct device devlist[N_DEV];
 static struct file_table ftable;
 
-#define FIRST_FILE (&ftable.files[0])
-#define LAST_FILE (&ftable.files[N_FILE - 1])
-
 void file_init(void)
 {
 	spin_lock_init(&ftable.lock, "ftable");
+	slab_cache_init(&ftable.cache, "file", sizeof(struct file), NULL);
 }
 
 struct file *file_alloc(void)
 {
 	struct file *f;
-	spin_lock_acquire(&ftable.lock);
-	for (f = FIRST_FILE; f <= LAST_FILE; f++) {
-		if (f->refcnt == 0) {
-			f->refcnt = 1;
-			spin_lock_release(&ftable.lock);
-			return f;
-		}
-	}
-	spin_lock_release(&ftable.lock);
-	return NULL;
+
+	if (!(f = slab_alloc(&ftable.cache)))
+		return NULL;
+	memset(f, 0, sizeof(*f));
+	f->refcnt = 1;
+	return f;
 }
 
 void file_close(struct file *f)
@@ -51,9 +47,10 @@ void file_close(struct file *f)
 	if (f->refcnt == 0) {
 		if (f->type == FD_PIPE)
 			pipe_close(f->pi, f->writable);
-		else
+		else if (f->inode)
 			iput(f->inode);
 		f->type = FD_NONE;
+		slab_free(&ftable.cache, f);
 	}
 	spin_lock_release(&ftable.lock);
 }
@@ -123,6 +120,9 @@ ssize_t file_read(struct file *f, uint64_t dst, size_t n)
 		ret = devlist[f->major].read(true, dst, n);
 		break;
 	case FD_INODE:
+		/* A fault under the inode lock could need another inode. */
+		if (uvm_prefault(dst, n, true))
+			return -1;
 		ilock(f->inode);
 		ret = readi(f->inode, true, dst, f->off, n);
 		if (ret > 0)
@@ -164,6 +164,9 @@ ssize_t file_write(struct file *f, uint64_t src, size_t n)
 		 * might be writing a device like the console.
 		 */
 		max = ((MAX_OP_BLKS - 1 - 1 - 2) / 2) * BLOCK_SIZE;
+		/* As in file_read(), the source may be this file's text. */
+		if (uvm_prefault(src, n, false))
+			return -1;
 		i = 0;
 		while (i < n) {
 			len = n - i;
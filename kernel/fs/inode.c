@@ -4,34 +4,49 @@
 #include "fs/log.h"
 #include "lib/string.h"
 #include "mm/mm.h"
+#include "mm/page_cache.h"
+#include "mm/slab.h"
 #include "param.h"
 #include "printk.h"
 #include "sched/cpu.h"
 
+#define N_INODE_BUCKETS 64
+
+/*
+ * Inodes in use come from a slab cache and are hashed by (dev, ino),
+ * so there is no fixed limit.  An inode is freed with its last
+ * reference.
+ */
 struct inode_table {
-	struct m_inode inodes[N_INODE];
-	struct spin_lock lock;
+	struct slab_cache cache;
+	struct m_inode *buckets[N_INODE_BUCKETS];
+	struct spin_lock lock; /* Protects the chains and every refcnt */
 };
 
 extern struct super_block sb;
 static struct inode_table itable;
 
-#define FIRST_INODE (&itable.inodes[0])
-#define LAST_INODE (&itable.inodes[N_INODE - 1])
+#define HASH(dev, ino) (((dev) * 31 + (ino)) % N_INODE_BUCKETS)
+
+static void inode_ctor(void *obj)
+{
+	struct m_inode *inode = obj;
+	sleep_lock_init(&inode->lock, "inode");
+}
 
 void iinit(void)
 {
-	struct m_inode *inode;
 	spin_lock_init(&itable.lock, "itable");
-	for (inode = FIRST_INODE; inode <= LAST_INODE; inode++)
-		sleep_lock_init(&inode->lock, "inode");
+	slab_cache_init(&itable.cache, "inode", sizeof(struct m_inode),
+			inode_ctor);
 }
 
 struct m_inode *ialloc(uint32_t dev, uint16_t type)
 {
 	uint32_t ino, byte, shift;
 	struct buffer *bitmap, *iblock;
-	struct d_inode *inode;
+	struct d_inode *di;
+	struct m_inode *inode;
 
 	ino = 0;
 	bitmap = bread(dev, sb.inode_bitmap_start);
@@ -39,52 +54,74 @@ struct m_inode *ialloc(uint32_t dev, uint16_t type)
 		for (shift = 0; shift < 8; shift++) {
 			if ((bitmap->data[byte] & (1 << shift)) == 0 &&
 			    !(byte == 0 && shift == 0)) {
+				ino = byte * 8 + shift;
+				/* Nothing is on disk yet if this fails. */
+				if (!(inode = iget(dev, ino)))
+					goto out;
 				bitmap->data[byte] |= (1 << shift);
 				log_write(bitmap);
 				brelse(bitmap);
-				ino = byte * 8 + shift;
 				iblock = bread(dev, IBLOCK(ino, sb));
-				inode = ((struct d_inode *)(iblock->data)) +
-					(ino % IPB);
-				memset(inode, 0, sizeof(*inode));
-				inode->type = type;
+				di = ((struct d_inode *)(iblock->data)) +
+				     (ino % IPB);
+				memset(di, 0, sizeof(*di));
+				di->type = type;
 				log_write(iblock);
 				brelse(iblock);
-				return iget(dev, ino);
+				return inode;
 			}
 		}
 	}
+out:
 	brelse(bitmap);
 	return NULL;
 }
 
-struct m_inode *iget(uint16_t dev, uint16_t ino)
+/* Find an inode in use.  Must be called with itable.lock held. */
+static struct m_inode *inode_lookup(uint16_t dev, uint16_t ino)
 {
-	struct m_inode *empty, *inode;
+	struct m_inode *inode;
 
-	spin_lock_acquire(&itable.lock);
-	empty = NULL;
-	for (inode = FIRST_INODE; inode <= LAST_INODE; inode++) {
-		if (inode->refcnt > 0 && inode->dev == dev &&
-		    inode->ino == ino) {
-			inode->refcnt++;
-			spin_lock_release(&itable.lock);
+	for (inode = itable.buckets[HASH(dev, ino)]; inode;
+	     inode = inode->next) {
+		if (inode->dev == dev && inode->ino == ino)
 			return inode;
-		}
-		if (empty == NULL && inode->refcnt == 0)
-			empty = inode;
 	}
+	return NULL;
+}
 
-	if (empty == NULL)
-		panic("no inodes");
+/* Return a referenced inode, or NULL if there is no memory for one. */
+struct m_inode *iget(uint16_t dev, uint16_t ino)
+{
+	struct m_inode *inode, *new, **head;
 
-	inode = empty;
-	inode->refcnt = 1;
-	inode->dev = dev;
-	inode->ino = ino;
-	inode->valid = false;
+	spin_lock_acquire(&itable.lock);
+	if ((inode = inode_lookup(dev, ino))) {
+		inode->refcnt++;
+		spin_lock_release(&itable.lock);
+		return inode;
+	}
 	spin_lock_release(&itable.lock);
-	return inode;
+
+	/* Allocate unlocked, reclaim may need the lock, then look again. */
+	if (!(new = slab_alloc(&itable.cache)))
+		return NULL;
+	spin_lock_acquire(&itable.lock);
+	if ((inode = inode_lookup(dev, ino))) {
+		inode->refcnt++;
+		spin_lock_release(&itable.lock);
+		slab_free(&itable.cache, new);
+		return inode;
+	}
+	new->refcnt = 1;
+	new->dev = dev;
+	new->ino = ino;
+	new->valid = false;
+	head = &itable.buckets[HASH(dev, ino)];
+	new->next = *head;
+	*head = new;
+	spin_lock_release(&itable.lock);
+	return new;
 }
 
 struct m_inode *idup(struct m_inode *inode)
@@ -132,6 +169,8 @@ void iunlock(struct m_inode *inode)
 
 void iput(struct m_inode *inode)
 {
+	struct m_inode **pp;
+
 	spin_lock_acquire(&itable.lock);
 	if (inode->refcnt == 1 && inode->valid && inode->nlink == 0) {
 		sleep_lock_acquire(&inode->lock);
@@ -143,8 +182,16 @@ void iput(struct m_inode *inode)
 		sleep_lock_release(&inode->lock);
 		spin_lock_acquire(&itable.lock);
 	}
-	inode->refcnt--;
+	if (--inode->refcnt > 0) {
+		spin_lock_release(&itable.lock);
+		return;
+	}
+	for (pp = &itable.buckets[HASH(inode->dev, inode->ino)]; *pp != inode;
+	     pp = &(*pp)->next)
+		;
+	*pp = inode->next;
 	spin_lock_release(&itable.lock);
+	slab_free(&itable.cache, inode);
 }
 
 void iupdate(struct m_inode *inode)
@@ -252,6 +299,8 @@ void itrunc(struct m_inode *inode)
 	struct buffer *b;
 	uint32_t *addrs;
 
+	page_cache_invalidate(inode, 0, inode->size);
+
 	for (i = 0; i < N_DIRECT; i++) {
 		if (inode->addrs[i]) {
 			bfree(inode->dev, inode->addrs[i]);
@@ -336,6 +385,7 @@ ssize_t writei(struct m_inode *inode, bool from_user, uint64_t src, off_t off,
 			brelse(b);
 			break;
 		}
+		page_cache_write(inode, off, b->data + off % BLOCK_SIZE, len);
 		log_write(b);
 		brelse(b);
 		off += len;
@@ -400,10 +450,12 @@ static struct m_inode *lookup(char *path, bool parent, char *name)
 {
 	struct m_inode *inode, *next;
 
-	if (*path == '/')
-		inode = iget(ROOT_DEV, ROOT_INO);
-	else
+	if (*path == '/') {
+		if (!(inode = iget(ROOT_DEV, ROOT_INO)))
+			return NULL;
+	} else {
 		inode = idup(running_proc()->cwd);
+	}
 
 	while ((path = skip_elem(path, name)) != NULL) {
 		ilock(inode);
@@ -443,7 +495,8 @@ struct m_inode *parenti(char *path, char *name)
 	return lookup(path, true, name);
 }
 
-struct m_inode *dir_lookup(struct m_inode *dir, char *name, size_t *poff)
+/* Return the inode number name links to in dir, or 0 if none. */
+uint16_t dir_find(struct m_inode *dir, char *name, size_t *poff)
 {
 	size_t off;
 	struct dir_entry de;
@@ -460,23 +513,32 @@ struct m_inode *dir_lookup(struct m_inode *dir, char *name, size_t *poff)
 		if (strncmp(de.name, name, DIR_SIZE) == 0) {
 			if (poff)
 				*poff = off;
-			return iget(dir->dev, de.ino);
+			return de.ino;
 		}
 	}
-	return NULL;
+	return 0;
+}
+
+/*
+ * Return the inode name links to in dir, or NULL if there is none or
+ * no memory for it.  Use dir_find() to tell the two apart.
+ */
+struct m_inode *dir_lookup(struct m_inode *dir, char *name, size_t *poff)
+{
+	uint16_t ino;
+
+	if (!(ino = dir_find(dir, name, poff)))
+		return NULL;
+	return iget(dir->dev, ino);
 }
 
 int dir_link(struct m_inode *dir, char *name, uint32_t ino)
 {
 	size_t off;
 	struct dir_entry de;
-	struct m_inode *inode;
 
-	inode = dir_lookup(dir, name, NULL);
-	if (inode) {
-		iput(inode);
+	if (dir_find(dir, name, NULL))
 		return -1;
-	}
 
 	for (off = 0; off < dir->size; off += sizeof(de)) {
 		if (readi(dir, false, (uint64_t)&de, off, sizeof(de)) !=
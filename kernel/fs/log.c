@@ -20,6 +20,7 @@ struct log {
 	bool committing;
 	uint32_t dev;
 	struct log_header lh;
+	struct wait_queue waiters; /* begin_op() waits for room */
 };
 
 static struct log lg;
@@ -33,6 +34,7 @@ void log_init(uint32_t dev, struct super_block *sb)
 		panic("too big log header");
 
 	spin_lock_init(&lg.lock, "log");
+	wait_queue_init(&lg.waiters);
 	lg.start = sb->log_start;
 	lg.size = sb->n_log_blks;
 	lg.dev = dev;
@@ -98,10 +100,10 @@ void begin_op(void)
 	spin_lock_acquire(&lg.lock);
 	while (true) {
 		if (lg.committing) {
-			sleep_on(&lg, &lg.lock);
+			sleep_on(&lg.waiters, &lg.lock);
 		} else if (lg.lh.n + (lg.outstanding + 1) * MAX_OP_BLKS >
 			   LOG_SIZE) {
-			sleep_on(&lg, &lg.lock);
+			sleep_on(&lg.waiters, &lg.lock);
 		} else {
 			lg.outstanding += 1;
 			spin_lock_release(&lg.lock);
@@ -122,7 +124,11 @@ void end_op(void)
 		do_committing = true;
 		lg.committing = true;
 	} else {
-		wake_up(&lg);
+		/*
+		 * Wake every waiter: one that finds the log still full
+		 * sleeps again, and must not take the wake-up of another.
+		 */
+		wake_up(&lg.waiters);
 	}
 	spin_lock_release(&lg.lock);
 
@@ -130,7 +136,7 @@ void end_op(void)
 		commit();
 		spin_lock_acquire(&lg.lock);
 		lg.committing = false;
-		wake_up(&lg);
+		wake_up(&lg.waiters);
 		spin_lock_release(&lg.lock);
 	}
 }
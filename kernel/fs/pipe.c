@@ -1,6 +1,7 @@
 #include "fs/pipe.h"
 #include "lock.h"
 #include "mm/mm.h"
+#include "mm/slab.h"
 #include "printk.h"
 #include "sched/cpu.h"
 
@@ -12,21 +13,40 @@ struct pipe {
 	uint32_t w;
 	bool read_open;
 	bool write_open;
+	struct wait_queue readers; /* waiting for data */
+	struct wait_queue writers; /* waiting for room */
 	char data[PIPE_SIZE];
 };
 
+/* Three pipes fit in a page. */
+static struct slab_cache pipe_cache;
+
+static void pipe_ctor(void *obj)
+{
+	struct pipe *pi = obj;
+	spin_lock_init(&pi->lock, "pipe");
+	wait_queue_init(&pi->readers);
+	wait_queue_init(&pi->writers);
+}
+
+void pipe_init(void)
+{
+	slab_cache_init(&pipe_cache, "pipe", sizeof(struct pipe), pipe_ctor);
+}
+
 int pipe_alloc(struct file **rfile, struct file **wfile)
 {
 	struct pipe *pi = NULL;
+
+	*rfile = *wfile = NULL;
 	if (!(*rfile = file_alloc()) || !(*wfile = file_alloc()))
 		goto bad;
-	if (!(pi = pm_alloc()))
+	if (!(pi = slab_alloc(&pipe_cache)))
 		goto bad;
 	pi->read_open = true;
 	pi->write_open = true;
 	pi->w = 0;
 	pi->r = 0;
-	spin_lock_init(&pi->lock, "pipe");
 	(*rfile)->type = FD_PIPE;
 	(*rfile)->readable = true;
 	(*rfile)->writable = false;
@@ -39,7 +59,7 @@ int pipe_alloc(struct file **rfile, struct file **wfile)
 
 bad:
 	if (pi)
-		pm_free(pi);
+		slab_free(&pipe_cache, pi);
 	if (*rfile) {
 		file_close(*rfile);
 		*rfile = NULL;
@@ -56,14 +76,14 @@ void pipe_close(struct pipe *pi, bool writable)
 	spin_lock_acquire(&pi->lock);
 	if (writable) {
 		pi->write_open = false;
-		wake_up(&pi->r);
+		wake_up(&pi->readers);
 	} else {
 		pi->read_open = false;
-		wake_up(&pi->w);
+		wake_up(&pi->writers);
 	}
 	if (!pi->read_open && !pi->write_open) {
 		spin_lock_release(&pi->lock);
-		pm_free(pi);
+		slab_free(&pipe_cache, pi);
 	} else {
 		spin_lock_release(&pi->lock);
 	}
@@ -75,13 +95,16 @@ ssize_t pipe_read(struct pipe *pi, uint64_t dst, size_t n)
 	size_t i = 0;
 	struct process *p = running_proc();
 
+	/* copy_out() must not fault under pi->lock. */
+	if (uvm_prefault(dst, n < PIPE_SIZE ? n : PIPE_SIZE, true))
+		return -1;
 	spin_lock_acquire(&pi->lock);
 	while (pi->r == pi->w && pi->write_open) {
 		if (killed(p)) {
 			spin_lock_release(&pi->lock);
 			return -1;
 		}
-		sleep_on(&pi->r, &pi->lock);
+		sleep_on(&pi->readers, &pi->lock);
 	}
 	for (i = 0; i < n; i++) {
 		if (pi->r == pi->w)
@@ -91,7 +114,7 @@ ssize_t pipe_read(struct pipe *pi, uint64_t dst, size_t n)
 		if (copy_out(p->page_table, dst + i, &c, 1))
 			break;
 	}
-	wake_up(&pi->w);
+	wake_up(&pi->writers);
 	spin_lock_release(&pi->lock);
 	return i;
 }
@@ -102,6 +125,9 @@ ssize_t pipe_write(struct pipe *pi, uint64_t src, size_t n)
 	size_t i = 0;
 	struct process *p = running_proc();
 
+	/* copy_in() must not fault under pi->lock. */
+	if (uvm_prefault(src, n, false))
+		return -1;
 	spin_lock_acquire(&pi->lock);
 	while (i < n) {
 		if (!pi->read_open || killed(p)) {
@@ -109,8 +135,8 @@ ssize_t pipe_write(struct pipe *pi, uint64_t src, size_t n)
 			return -1;
 		}
 		if ((pi->w + 1) % PIPE_SIZE == pi->r) {
-			wake_up(&pi->r);
-			sleep_on(&pi->w, &pi->lock);
+			wake_up(&pi->readers);
+			sleep_on(&pi->writers, &pi->lock);
 		} else {
 			if (copy_in(p->page_table, &c, src, 1))
 				break;
@@ -120,7 +146,7 @@ ssize_t pipe_write(struct pipe *pi, uint64_t src, size_t n)
 			src++;
 		}
 	}
-	wake_up(&pi->r);
+	wake_up(&pi->readers);
 	spin_lock_release(&pi->lock);
 	return i;
 }
@@ -1,22 +1,115 @@
 #include "lib/string.h"
+#include "riscv.h"
+
+/*
+ * memset() and memmove() work a word at a time, eight words per loop,
+ * wherever the buffers allow aligned word accesses.  Bytes before the
+ * first aligned word and after the last one are handled one by one.
+ */
+
+#define WORD_SIZE sizeof(uint64_t)
+#define WORD_MASK (WORD_SIZE - 1)
+#define CHUNK_SIZE (8 * WORD_SIZE)
 
 void *memset(void *ptr, int v, size_t n)
 {
-	while (n > 0)
-		((uint8_t *)ptr)[--n] = v;
+	uint8_t *p = ptr;
+	uint64_t *w, word;
+
+	for (; n > 0 && ((uint64_t)p & WORD_MASK); n--)
+		*p++ = v;
+
+	word = (uint8_t)v * 0x0101010101010101ul;
+	w = (uint64_t *)p;
+	for (; n >= CHUNK_SIZE; n -= CHUNK_SIZE, w += 8) {
+		w[0] = word;
+		w[1] = word;
+		w[2] = word;
+		w[3] = word;
+		w[4] = word;
+		w[5] = word;
+		w[6] = word;
+		w[7] = word;
+	}
+	for (; n >= WORD_SIZE; n -= WORD_SIZE)
+		*w++ = word;
+
+	p = (uint8_t *)w;
+	while (n-- > 0)
+		*p++ = v;
 	return ptr;
 }
 
-void *memmove(void *dst, const void *src, size_t n)
+static void copy_forward(uint8_t *d, const uint8_t *s, size_t n)
 {
-	size_t i;
-	if (dst < src) {
-		for (i = 0; i < n; ++i)
-			((uint8_t *)dst)[i] = ((const uint8_t *)src)[i];
-	} else {
-		for (i = n; i--;)
-			((uint8_t *)dst)[i] = ((const uint8_t *)src)[i];
+	uint64_t *dw;
+	const uint64_t *sw;
+
+	/* Words only if both can be aligned at once. */
+	if ((((uint64_t)d ^ (uint64_t)s) & WORD_MASK) == 0) {
+		for (; n > 0 && ((uint64_t)d & WORD_MASK); n--)
+			*d++ = *s++;
+		dw = (uint64_t *)d;
+		sw = (const uint64_t *)s;
+		for (; n >= CHUNK_SIZE; n -= CHUNK_SIZE, dw += 8, sw += 8) {
+			dw[0] = sw[0];
+			dw[1] = sw[1];
+			dw[2] = sw[2];
+			dw[3] = sw[3];
+			dw[4] = sw[4];
+			dw[5] = sw[5];
+			dw[6] = sw[6];
+			dw[7] = sw[7];
+		}
+		for (; n >= WORD_SIZE; n -= WORD_SIZE)
+			*dw++ = *sw++;
+		d = (uint8_t *)dw;
+		s = (const uint8_t *)sw;
 	}
+	while (n-- > 0)
+		*d++ = *s++;
+}
+
+/* Copy from the end, for a dst that overlaps the end of src. */
+static void copy_backward(uint8_t *d, const uint8_t *s, size_t n)
+{
+	uint64_t *dw;
+	const uint64_t *sw;
+
+	d += n;
+	s += n;
+	if ((((uint64_t)d ^ (uint64_t)s) & WORD_MASK) == 0) {
+		for (; n > 0 && ((uint64_t)d & WORD_MASK); n--)
+			*--d = *--s;
+		dw = (uint64_t *)d;
+		sw = (const uint64_t *)s;
+		for (; n >= CHUNK_SIZE; n -= CHUNK_SIZE) {
+			dw -= 8;
+			sw -= 8;
+			dw[7] = sw[7];
+			dw[6] = sw[6];
+			dw[5] = sw[5];
+			dw[4] = sw[4];
+			dw[3] = sw[3];
+			dw[2] = sw[2];
+			dw[1] = sw[1];
+			dw[0] = sw[0];
+		}
+		for (; n >= WORD_SIZE; n -= WORD_SIZE)
+			*--dw = *--sw;
+		d = (uint8_t *)dw;
+		s = (const uint8_t *)sw;
+	}
+	while (n-- > 0)
+		*--d = *--s;
+}
+
+void *memmove(void *dst, const void *src, size_t n)
+{
+	if (dst <= src || (const uint8_t *)src + n <= (uint8_t *)dst)
+		copy_forward(dst, src, n);
+	else
+		copy_backward(dst, src, n);
 	return dst;
 }
 
@@ -25,6 +118,41 @@ void *memcpy(void *dst, const void *src, size_t n)
 	return memmove(dst, src, n);
 }
 
+/* Zero a page-aligned page, without the checks of memset(). */
+void page_zero(void *page)
+{
+	uint64_t *w = page, *end = w + PAGE_SIZE / WORD_SIZE;
+
+	for (; w < end; w += 8) {
+		w[0] = 0;
+		w[1] = 0;
+		w[2] = 0;
+		w[3] = 0;
+		w[4] = 0;
+		w[5] = 0;
+		w[6] = 0;
+		w[7] = 0;
+	}
+}
+
+/* Copy a page-aligned page to another. */
+void page_copy(void *dst, const void *src)
+{
+	uint64_t *d = dst, *end = d + PAGE_SIZE / WORD_SIZE;
+	const uint64_t *s = src;
+
+	for (; d < end; d += 8, s += 8) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+		d[3] = s[3];
+		d[4] = s[4];
+		d[5] = s[5];
+		d[6] = s[6];
+		d[7] = s[7];
+	}
+}
+
 size_t strlen(const char *s)
 {
 	size_t len = 0;
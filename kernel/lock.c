@@ -1,26 +1,161 @@
 #include "lock.h"
+#include "dev/timer.h"
+#include "lib/string.h"
 #include "printk.h"
 #include "riscv.h"
 #include "sched/cpu.h"
 
+#ifdef LOCK_STAT
+#define N_LOCK_STAT 64
+
+/* Contention of the spin locks of one name. */
+struct lock_stat {
+	const char *name;
+	uint64_t acquired;  /* Acquisitions */
+	uint64_t contended; /* Acquisitions that had to spin */
+	uint64_t spin;	    /* read_time() spent spinning */
+	uint64_t max_hold;  /* Longest the lock was held */
+};
+
+/* Claimed by name without a lock, which would itself be counted. */
+static struct lock_stat lock_stats[N_LOCK_STAT];
+static struct lock_stat lock_stat_other = { .name = "(other)" };
+
+static struct lock_stat *lock_stat_get(const char *name)
+{
+	struct lock_stat *s;
+
+	for (s = lock_stats; s < lock_stats + N_LOCK_STAT; s++) {
+		if (!s->name && __sync_bool_compare_and_swap(&s->name, NULL,
+							     name))
+			return s;
+		if (strncmp(s->name, name, 32) == 0)
+			return s;
+	}
+	return &lock_stat_other;
+}
+
+static void lock_stat_acquired(struct spin_lock *lock, uint64_t spin,
+			       bool contended)
+{
+	struct lock_stat *s;
+
+	/* Statically initialized locks find their entry on first use. */
+	if (!lock->stat)
+		lock->stat = lock_stat_get(lock->name);
+	s = lock->stat;
+	__sync_fetch_and_add(&s->acquired, 1);
+	if (contended) {
+		__sync_fetch_and_add(&s->contended, 1);
+		__sync_fetch_and_add(&s->spin, spin);
+	}
+	lock->acquired_at = read_time();
+}
+
+static void lock_stat_released(struct spin_lock *lock)
+{
+	struct lock_stat *s = lock->stat;
+	uint64_t hold, max;
+
+	hold = read_time() - lock->acquired_at;
+	while ((max = s->max_hold) < hold &&
+	       !__sync_bool_compare_and_swap(&s->max_hold, max, hold))
+		continue;
+}
+
+/* Print the locks that were contended, the most spun on first. */
+void lock_stat_dump(void)
+{
+	bool printed[N_LOCK_STAT];
+	struct lock_stat *s, *top;
+	int i;
+
+	memset(printed, 0, sizeof(printed));
+	while (true) {
+		top = NULL;
+		for (i = 0; i < N_LOCK_STAT; i++) {
+			s = &lock_stats[i];
+			if (s->name && !printed[i] &&
+			    (!top || s->spin > top->spin))
+				top = s;
+		}
+		if (!top)
+			break;
+		printed[top - lock_stats] = true;
+		printk("lock %s: %lu acquired, %lu contended, spun %lu ns, "
+		       "held at most %lu ns\n",
+		       top->name, top->acquired, top->contended,
+		       top->spin * (1000000000 / TIMER_FREQ),
+		       top->max_hold * (1000000000 / TIMER_FREQ));
+	}
+	if (lock_stat_other.acquired)
+		printk("lock %s: %lu acquired, %lu contended\n",
+		       lock_stat_other.name, lock_stat_other.acquired,
+		       lock_stat_other.contended);
+}
+#else
+void lock_stat_dump(void)
+{
+}
+#endif
+
 void spin_lock_init(struct spin_lock *lock, const char *name)
 {
-	lock->locked = false;
+	lock->next = 0;
+	lock->owner = 0;
 	lock->cpuid = -1;
 	lock->name = name;
+#ifdef LOCK_STAT
+	lock->stat = NULL;
+#endif
 }
 
 void spin_lock_acquire(struct spin_lock *lock)
 {
+	uint32_t ticket;
+#ifdef LOCK_STAT
+	uint64_t start = 0;
+	bool contended;
+#endif
+
 	push_off();
 	if (spin_lock_holding(lock)) {
 		printk("spin lock name: %s\n", lock->name);
 		panic("repeatedly acquire lock");
 	}
-	while (__sync_lock_test_and_set(&lock->locked, true))
+	ticket = __sync_fetch_and_add(&lock->next, 1);
+#ifdef LOCK_STAT
+	if ((contended = *(volatile uint32_t *)&lock->owner != ticket))
+		start = read_time();
+#endif
+	/* Waiters only read owner, so its line is shared until released. */
+	while (*(volatile uint32_t *)&lock->owner != ticket)
 		continue;
 	__sync_synchronize();
 	lock->cpuid = current_cpuid();
+#ifdef LOCK_STAT
+	lock_stat_acquired(lock, contended ? read_time() - start : 0,
+			   contended);
+#endif
+}
+
+/* Take the lock only if it is free.  Return whether it was taken. */
+bool spin_lock_try(struct spin_lock *lock)
+{
+	uint32_t owner;
+
+	push_off();
+	owner = *(volatile uint32_t *)&lock->owner;
+	if (!__sync_bool_compare_and_swap(&lock->next, owner, owner + 1)) {
+		pop_off();
+		return false;
+	}
+	__sync_synchronize();
+	lock->cpuid = current_cpuid();
+#ifdef LOCK_STAT
+	lock_stat_acquired(lock, 0, false);
+#endif
+	return true;
 }
 
 void spin_lock_release(struct spin_lock *lock)
@@ -29,15 +164,19 @@ void spin_lock_release(struct spin_lock *lock)
 		printk("spin lock name: %s\n", lock->name);
 		panic("release unheld lock");
 	}
+#ifdef LOCK_STAT
+	lock_stat_released(lock);
+#endif
 	lock->cpuid = -1;
 	__sync_synchronize();
-	__sync_lock_release(&lock->locked);
+	/* Only the holder writes owner, which hands the lock on in order. */
+	*(volatile uint32_t *)&lock->owner = lock->owner + 1;
 	pop_off();
 }
 
 bool spin_lock_holding(struct spin_lock *lock)
 {
-	return lock->locked && lock->cpuid == current_cpuid();
+	return lock->owner != lock->next && lock->cpuid == current_cpuid();
 }
 
 void sleep_lock_init(struct sleep_lock *lock, const char *name)
@@ -46,6 +185,7 @@ void sleep_lock_init(struct sleep_lock *lock, const char *name)
 	lock->locked = false;
 	lock->pid = -1;
 	lock->name = name;
+	wait_queue_init(&lock->waiters);
 }
 
 void sleep_lock_acquire(struct sleep_lock *lock)
@@ -56,7 +196,7 @@ void sleep_lock_acquire(struct sleep_lock *lock)
 	}
 	spin_lock_acquire(&lock->lock);
 	while (lock->locked)
-		sleep_on(lock, &lock->lock);
+		sleep_on(&lock->waiters, &lock->lock);
 	lock->locked = true;
 	lock->pid = running_proc()->pid;
 	spin_lock_release(&lock->lock);
@@ -71,7 +211,8 @@ void sleep_lock_release(struct sleep_lock *lock)
 	spin_lock_acquire(&lock->lock);
 	lock->locked = false;
 	lock->pid = -1;
-	wake_up(lock);
+	/* Only one of the waiters can take the lock. */
+	wake_up_one(&lock->waiters);
 	spin_lock_release(&lock->lock);
 }
 
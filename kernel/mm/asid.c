@@ -0,0 +1,114 @@
+#include "mm/asid.h"
+#include "lock.h"
+#include "printk.h"
+#include "riscv.h"
+#include "sched/cpu.h"
+
+/*
+ * Address space identifiers tag the TLB entries of each process, so
+ * that switching page tables does not flush the TLB.  ASID 0 belongs
+ * to the kernel page table.
+ *
+ * ASIDs are handed out in generations.  p->asid holds the generation
+ * above the low SATP_ASID_BITS bits.  When a generation runs out, a new
+ * one starts and every hart flushes its whole TLB before it runs a
+ * process of the new generation, so stale entries of a reused ASID are
+ * never seen.  A process keeps its ASID until exec or the next
+ * generation.
+ */
+
+struct asid_allocator {
+	struct spin_lock lock;
+	uint64_t generation; /* Current generation, starting at 1 */
+	uint64_t next;	     /* Next free ASID in this generation */
+	uint64_t max;	     /* Number of ASIDs of the hardware */
+	uint64_t rollovers;
+};
+
+static struct asid_allocator asids;
+
+#define ASID(a) ((a) & SATP_ASID_MASK)
+#define GENERATION(a) ((a) >> SATP_ASID_BITS)
+
+/* Find out how many ASID bits the hardware implements. */
+void asid_init(void)
+{
+	uint64_t satp;
+
+	spin_lock_init(&asids.lock, "asid");
+	satp = read_satp();
+	write_satp(satp | ((uint64_t)SATP_ASID_MASK << SATP_ASID_SHIFT));
+	asids.max = ((read_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK) + 1;
+	write_satp(satp);
+	sfence_vma();
+	asids.generation = 1;
+	asids.next = 1;
+	printk("asid: %lu ASIDs\n", asids.max);
+}
+
+/* Give p an ASID of the current generation. */
+static void asid_alloc(struct process *p)
+{
+	spin_lock_acquire(&asids.lock);
+	if (GENERATION(p->asid) != asids.generation) {
+		if (asids.next >= asids.max) {
+			asids.generation++;
+			asids.next = 1;
+			asids.rollovers++;
+		}
+		p->asid = (asids.generation << SATP_ASID_BITS) | asids.next++;
+		/* Its TLB entries from before, if any, are all stale. */
+		p->tlb_stale = ~0ul;
+	}
+	spin_lock_release(&asids.lock);
+}
+
+/*
+ * Return the satp to run p with on this hart, flushing what this hart
+ * may have cached that p must not see.  Called with interrupts off.
+ */
+uint64_t asid_satp(struct process *p)
+{
+	struct cpu *c = current_cpu();
+	uint64_t bit = 1ul << current_cpuid();
+
+	/* Without ASIDs, return_to_user_space() flushes everything. */
+	if (asids.max <= 1)
+		return MAKE_SATP(p->page_table);
+
+	if (GENERATION(p->asid) != asids.generation)
+		asid_alloc(p);
+	if (c->asid_generation != GENERATION(p->asid)) {
+		c->asid_generation = GENERATION(p->asid);
+		sfence_vma();
+		__sync_fetch_and_and(&p->tlb_stale, ~bit);
+	} else if (p->tlb_stale & bit) {
+		__sync_fetch_and_and(&p->tlb_stale, ~bit);
+		sfence_vma_asid(ASID(p->asid));
+	}
+	return MAKE_SATP(p->page_table) |
+	       (ASID(p->asid) << SATP_ASID_SHIFT);
+}
+
+/* Drop p's ASID after its page table is replaced. */
+void asid_release(struct process *p)
+{
+	p->asid = 0;
+}
+
+/*
+ * A mapping of p at va lost a page or a permission.  Flush it here,
+ * and flush p's ASID on the other harts before p runs there again.
+ */
+void asid_flush_page(struct process *p, uint64_t va)
+{
+	uint64_t bit;
+
+	if (asids.max <= 1 || p->asid == 0)
+		return;
+	push_off();
+	bit = 1ul << current_cpuid();
+	sfence_vma_page(va, ASID(p->asid));
+	__sync_fetch_and_or(&p->tlb_stale, ~bit);
+	pop_off();
+}
@@ -1,80 +1,515 @@
 #include "mm/mm.h"
 #include "lib/string.h"
 #include "memlayout.h"
+#include "mm/asid.h"
+#include "mm/shrinker.h"
 #include "printk.h"
 #include "riscv.h"
+#include "sbi.h"
 #include "sched/cpu.h"
 
-struct free_list_node {
-	struct free_list_node *next;
+/* Free blocks are 2^0 to 2^(PM_MAX_ORDER - 1) contiguous pages. */
+#define PM_MAX_ORDER 10
+
+#define N_PAGES ((MAX_PADDR - KERNEL_START) / PAGE_SIZE)
+
+#define PG_BUDDY (1 << 0) /* Heads a free block of 2^order pages */
+
+/* One descriptor for each physical page above KERNEL_START. */
+struct page {
+	/* For the free list of its order, valid with PG_BUDDY */
+	struct page *prev;
+	struct page *next;
+	uint8_t flags;
+	uint8_t order;
+	uint32_t refcnt; /* Page tables and users holding the page */
+};
+
+struct free_area {
+	/*
+	 * Circular list of free blocks of one order, through prev/next.
+	 * head itself is not a page.
+	 */
+	struct page head;
+	uint64_t count;
 };
 
-struct free_list {
-	struct free_list_node *head;
+struct buddy {
+	struct spin_lock lock;
+	struct free_area areas[PM_MAX_ORDER];
+	uint64_t free_pages;
+	uint64_t total_pages; /* Pages given to pm_init() */
+};
+
+/* Free pages zeroed by idle harts, see pm_zero_idle(). */
+#define ZERO_POOL_SIZE 128
+
+struct zero_pool {
 	struct spin_lock lock;
+	int count;
+	void *pages[ZERO_POOL_SIZE];
+
+	/* statistics */
+	uint64_t hits;	 /* pm_zalloc() took a page from the pool */
+	uint64_t misses; /* pm_zalloc() zeroed a page itself */
+	uint64_t zeroed; /* pages zeroed by idle harts */
 };
 
 extern char _text_start[];
 extern char _text_end[];
 extern char _kernel_end[];
 extern char trampoline[];
-static struct free_list kernel_free_list;
+static struct page pages[N_PAGES];
+static struct buddy buddy;
+static struct zero_pool zero_pool;
+
+/* Registered at boot and never removed, so walked without the lock. */
+static struct spin_lock shrinkers_lock = {
+	.cpuid = -1,
+	.name = "shrinkers",
+};
+static struct shrinker *shrinkers;
 static pte_t *kernel_page_table;
 
 #define TEXT_START ((uint64_t)_text_start)
 #define TEXT_END ((uint64_t)_text_end)
 #define KERNEL_END ((uint64_t)_kernel_end)
 
+#define PA2PAGE(pa) (&pages[((uint64_t)(pa) - KERNEL_START) / PAGE_SIZE])
+#define PAGE2PA(pg) (KERNEL_START + (uint64_t)((pg) - pages) * PAGE_SIZE)
+
+static void free_area_add(struct page *pg, int order)
+{
+	struct free_area *area = &buddy.areas[order];
+	pg->flags |= PG_BUDDY;
+	pg->order = order;
+	pg->next = area->head.next;
+	pg->prev = &area->head;
+	area->head.next->prev = pg;
+	area->head.next = pg;
+	area->count++;
+}
+
+static void free_area_del(struct page *pg)
+{
+	pg->next->prev = pg->prev;
+	pg->prev->next = pg->next;
+	pg->next = pg->prev = NULL;
+	pg->flags &= ~PG_BUDDY;
+	buddy.areas[pg->order].count--;
+}
+
+/*
+ * Take a block of 2^order pages, splitting a larger one if needed.
+ * Must be called with buddy.lock held.
+ */
+static struct page *buddy_alloc(int order)
+{
+	struct page *pg;
+	int o;
+
+	for (o = order; o < PM_MAX_ORDER; o++) {
+		if (buddy.areas[o].count > 0)
+			break;
+	}
+	if (o == PM_MAX_ORDER)
+		return NULL;
+
+	pg = buddy.areas[o].head.next;
+	free_area_del(pg);
+	/* Give the upper halves back until the block is small enough. */
+	while (o > order) {
+		o--;
+		free_area_add(pg + (1 << o), o);
+	}
+	buddy.free_pages -= 1 << order;
+	return pg;
+}
+
+/*
+ * Return a block of 2^order pages, merging it with its buddy for as
+ * long as the buddy is free as a whole.
+ * Must be called with buddy.lock held.
+ */
+static void buddy_free(struct page *pg, int order)
+{
+	uint64_t idx, buddy_idx;
+	struct page *b;
+
+	buddy.free_pages += 1 << order;
+	idx = pg - pages;
+	while (order < PM_MAX_ORDER - 1) {
+		buddy_idx = idx ^ (1ul << order);
+		if (buddy_idx >= N_PAGES)
+			break;
+		b = &pages[buddy_idx];
+		if (!(b->flags & PG_BUDDY) || b->order != order)
+			break;
+		free_area_del(b);
+		idx &= ~(1ul << order);
+		order++;
+	}
+	free_area_add(&pages[idx], order);
+}
+
 void pm_init(void)
 {
 	uint64_t ptr;
-	kernel_free_list.head = NULL;
-	spin_lock_init(&kernel_free_list.lock, "free_list");
-	for (ptr = KERNEL_END; ptr < MAX_PADDR; ptr += PAGE_SIZE) {
-		((struct free_list_node *)ptr)->next = kernel_free_list.head;
-		kernel_free_list.head = (struct free_list_node *)ptr;
+	int order;
+
+	spin_lock_init(&buddy.lock, "buddy");
+	for (order = 0; order < PM_MAX_ORDER; order++) {
+		buddy.areas[order].head.prev = &buddy.areas[order].head;
+		buddy.areas[order].head.next = &buddy.areas[order].head;
+		buddy.areas[order].count = 0;
 	}
+	buddy.free_pages = 0;
+	for (ptr = KERNEL_END; ptr < MAX_PADDR; ptr += PAGE_SIZE)
+		buddy_free(PA2PAGE(ptr), 0);
+	buddy.total_pages = buddy.free_pages;
+	spin_lock_init(&zero_pool.lock, "zero_pool");
 }
 
-void *pm_alloc(void)
+static void check_block(void *ptr, int order)
 {
+	uint64_t pa = (uint64_t)ptr;
+
+	if (order < 0 || order >= PM_MAX_ORDER)
+		panic("invalid allocation order");
+	if (pa < KERNEL_END || pa >= MAX_PADDR)
+		panic("free a page out of range");
+	if (pa % (PAGE_SIZE << order) != 0)
+		panic("free a misaligned block");
+	if (PA2PAGE(pa)->refcnt < 1)
+		panic("free a free page");
+}
+
+/*
+ * Move up to PM_CACHE_BATCH pages from the buddy allocator into the
+ * cache of this hart.  Must be called with interrupts off.
+ */
+static void pm_cache_refill(struct pm_cache *pc)
+{
+	struct page *pg;
+	int first, i, j;
+	void *tmp;
+
+	pc->refills++;
+	first = pc->count;
+	spin_lock_acquire(&buddy.lock);
+	while (pc->count < PM_CACHE_BATCH) {
+		if (!(pg = buddy_alloc(0)))
+			break;
+		pc->pages[pc->count++] = (void *)PAGE2PA(pg);
+	}
+	spin_lock_release(&buddy.lock);
+
+	/*
+	 * Split blocks come out in ascending order.  Reverse them, so that
+	 * pm_alloc() hands them out ascending too, and pages faulted in one
+	 * after another tend to be physically contiguous for uvm_span().
+	 */
+	for (i = first, j = pc->count - 1; i < j; i++, j--) {
+		tmp = pc->pages[i];
+		pc->pages[i] = pc->pages[j];
+		pc->pages[j] = tmp;
+	}
+}
+
+/*
+ * Give PM_CACHE_BATCH pages from the cache of this hart back to the
+ * buddy allocator.  Must be called with interrupts off.
+ */
+static void pm_cache_drain(struct pm_cache *pc)
+{
+	int i;
+
+	pc->drains++;
+	spin_lock_acquire(&buddy.lock);
+	for (i = 0; i < PM_CACHE_BATCH; i++)
+		buddy_free(PA2PAGE(pc->pages[--pc->count]), 0);
+	spin_lock_release(&buddy.lock);
+}
+
+/* Take a page from the zero pool, or return NULL if it is empty. */
+static void *zero_pool_take(void)
+{
+	void *ptr = NULL;
+
+	spin_lock_acquire(&zero_pool.lock);
+	if (zero_pool.count > 0) {
+		ptr = zero_pool.pages[--zero_pool.count];
+		PA2PAGE(ptr)->refcnt = 1;
+	}
+	spin_lock_release(&zero_pool.lock);
+	return ptr;
+}
+
+void shrinker_register(struct shrinker *s)
+{
+	struct shrinker **pp;
+
+	s->next = NULL;
+	spin_lock_acquire(&shrinkers_lock);
+	for (pp = &shrinkers; *pp; pp = &(*pp)->next)
+		continue;
+	__sync_synchronize();
+	*pp = s;
+	spin_lock_release(&shrinkers_lock);
+}
+
+/*
+ * Ask the shrinkers, in order, to free nr pages.  Return how many did.
+ * Only on behalf of a process: background work run by scheduler(),
+ * like pm_zero_idle(), must not evict caches to get its pages.
+ */
+size_t pm_reclaim(size_t nr)
+{
+	struct shrinker *s;
+	size_t n, total = 0;
+
+	if (!running_proc())
+		return 0;
+	for (s = shrinkers; s && total < nr; s = s->next) {
+		n = s->shrink(nr - total);
+		__sync_fetch_and_add(&s->reclaimed, n);
+		total += n;
+	}
+	return total;
+}
+
+static void *pm_cache_alloc(void)
+{
+	struct pm_cache *pc;
 	void *ptr = NULL;
-	spin_lock_acquire(&kernel_free_list.lock);
-	if (kernel_free_list.head) {
-		ptr = kernel_free_list.head;
-		kernel_free_list.head = kernel_free_list.head->next;
+
+	push_off();
+	pc = &current_cpu()->pm_cache;
+	if (pc->count > 0) {
+		pc->alloc_hits++;
+	} else {
+		pc->alloc_misses++;
+		pm_cache_refill(pc);
+	}
+	if (pc->count > 0) {
+		ptr = pc->pages[--pc->count];
+		PA2PAGE(ptr)->refcnt = 1;
 	}
-	spin_lock_release(&kernel_free_list.lock);
+	pop_off();
+	return ptr;
+}
+
+/* Allocate a page, reclaiming cache pages if none is free. */
+void *pm_alloc(void)
+{
+	void *ptr;
+
+	if ((ptr = pm_cache_alloc()))
+		return ptr;
+	/* The zero pool is free memory too. */
+	if ((ptr = zero_pool_take()))
+		return ptr;
+	/* Freed pages go to the cache of this hart, so try it again. */
+	if (pm_reclaim(PM_CACHE_BATCH) > 0)
+		ptr = pm_cache_alloc();
 	return ptr;
 }
 
 void *pm_zalloc(void)
 {
-	void *ptr = pm_alloc();
-	if (ptr)
-		memset(ptr, 0, PAGE_SIZE);
+	void *ptr;
+
+	if ((ptr = zero_pool_take())) {
+		__sync_fetch_and_add(&zero_pool.hits, 1);
+		return ptr;
+	}
+	__sync_fetch_and_add(&zero_pool.misses, 1);
+	if ((ptr = pm_alloc()))
+		page_zero(ptr);
 	return ptr;
 }
 
+/*
+ * Zero up to PM_CACHE_BATCH free pages into the zero pool.  Called by
+ * scheduler() when there is nothing to run.  The pages come straight
+ * from the buddy allocator, so that neither the pool itself nor the
+ * statistics of the hart caches feed it.  Return whether the pool
+ * gained a page, so that the caller looks for work again before
+ * waiting for an interrupt.
+ */
+bool pm_zero_idle(void)
+{
+	struct page *pg;
+	void *ptr;
+	int added = 0;
+
+	while (added < PM_CACHE_BATCH && zero_pool.count < ZERO_POOL_SIZE) {
+		spin_lock_acquire(&buddy.lock);
+		pg = buddy_alloc(0);
+		spin_lock_release(&buddy.lock);
+		if (!pg)
+			break;
+		ptr = (void *)PAGE2PA(pg);
+		page_zero(ptr);
+		spin_lock_acquire(&zero_pool.lock);
+		if (zero_pool.count < ZERO_POOL_SIZE) {
+			zero_pool.pages[zero_pool.count++] = ptr;
+			zero_pool.zeroed++;
+			added++;
+			ptr = NULL;
+		}
+		spin_lock_release(&zero_pool.lock);
+		if (ptr) {
+			spin_lock_acquire(&buddy.lock);
+			buddy_free(pg, 0);
+			spin_lock_release(&buddy.lock);
+			break;
+		}
+	}
+	return added > 0;
+}
+
+/* Drop a reference to a page, freeing it with the last one. */
 void pm_free(void *ptr)
 {
-	spin_lock_acquire(&kernel_free_list.lock);
-	((struct free_list_node *)ptr)->next = kernel_free_list.head;
-	kernel_free_list.head = ptr;
-	spin_lock_release(&kernel_free_list.lock);
+	struct pm_cache *pc;
+
+	check_block(ptr, 0);
+	if (__sync_sub_and_fetch(&PA2PAGE(ptr)->refcnt, 1) > 0)
+		return;
+	push_off();
+	pc = &current_cpu()->pm_cache;
+	if (pc->count < PM_CACHE_SIZE) {
+		pc->free_hits++;
+	} else {
+		pc->free_misses++;
+		pm_cache_drain(pc);
+	}
+	pc->pages[pc->count++] = ptr;
+	pop_off();
 }
 
-pte_t *walk(pte_t *page_table, uint64_t va, bool alloc)
+/* Take another reference to a page returned by pm_alloc(). */
+void pm_dup(void *ptr)
 {
-	int level;
+	check_block(ptr, 0);
+	__sync_fetch_and_add(&PA2PAGE(ptr)->refcnt, 1);
+}
+
+/* Number of references to a page returned by pm_alloc(). */
+uint32_t pm_refcnt(void *ptr)
+{
+	return PA2PAGE(ptr)->refcnt;
+}
+
+/* Allocate 2^order physically contiguous pages, aligned to their size. */
+void *pm_alloc_pages(int order)
+{
+	struct page *pg;
+
+	if (order == 0)
+		return pm_alloc();
+	if (order < 0 || order >= PM_MAX_ORDER)
+		return NULL;
+	spin_lock_acquire(&buddy.lock);
+	pg = buddy_alloc(order);
+	spin_lock_release(&buddy.lock);
+	if (!pg)
+		return NULL;
+	pg->refcnt = 1;
+	return (void *)PAGE2PA(pg);
+}
+
+void pm_free_pages(void *ptr, int order)
+{
+	if (order == 0) {
+		pm_free(ptr);
+		return;
+	}
+	check_block(ptr, order);
+	PA2PAGE(ptr)->refcnt = 0;
+	spin_lock_acquire(&buddy.lock);
+	buddy_free(PA2PAGE(ptr), order);
+	spin_lock_release(&buddy.lock);
+}
+
+/*
+ * Count the pages managed by the allocator and the free ones, wherever
+ * they wait: in the buddy allocator, the caches of the harts or the
+ * zero pool.  The caches of other harts are read without locking, so
+ * the count is a snapshot.
+ */
+void pm_stat(uint64_t *total, uint64_t *free)
+{
+	int id;
+
+	*total = buddy.total_pages;
+	*free = buddy.free_pages + zero_pool.count;
+	for (id = 0; id < N_CPU; id++)
+		*free += cpu_get(id)->pm_cache.count;
+}
+
+void pm_dump(void)
+{
+	struct pm_cache *pc;
+	struct shrinker *s;
+	uint64_t allocs, frees, total, free;
+	int id, order;
+
+	pm_stat(&total, &free);
+	printk("memory: %lu pages, %lu free, %lu used\n", total, free,
+	       total - free);
+
+	for (id = 0; id < N_CPU; id++) {
+		pc = &cpu_get(id)->pm_cache;
+		allocs = pc->alloc_hits + pc->alloc_misses;
+		frees = pc->free_hits + pc->free_misses;
+		printk("hart %d: alloc %lu/%lu hits, free %lu/%lu hits, "
+		       "%lu refills, %lu drains, %d cached\n",
+		       id, pc->alloc_hits, allocs, pc->free_hits, frees,
+		       pc->refills, pc->drains, pc->count);
+	}
+
+	/*
+	 * Free blocks of each order.  Many small blocks next to few large
+	 * ones mean memory is fragmented.
+	 */
+	printk("buddy: %lu free pages, blocks by order:", buddy.free_pages);
+	for (order = 0; order < PM_MAX_ORDER; order++)
+		printk(" %lu", buddy.areas[order].count);
+	printk("\n");
+
+	printk("zero pool: %d pages, zalloc %lu/%lu hits, "
+	       "%lu zeroed while idle\n",
+	       zero_pool.count, zero_pool.hits,
+	       zero_pool.hits + zero_pool.misses, zero_pool.zeroed);
+
+	for (s = shrinkers; s; s = s->next)
+		printk("shrinker %s: %lu pages reclaimed\n", s->name,
+		       s->reclaimed);
+}
+
+/*
+ * Return the PTE for va at *level, allocating page-table pages on the
+ * way if alloc is set.  If a superpage maps va above *level, its PTE
+ * is returned instead and *level is set to its level.
+ */
+static pte_t *walk_level(pte_t *page_table, uint64_t va, int *level,
+			 bool alloc)
+{
+	int l;
 	pte_t *pte;
 
 	if (va >= MAX_VADDR)
 		return NULL;
 
-	for (level = 2; level > 0; level--) {
-		pte = &page_table[PX(va, level)];
+	for (l = 2; l > *level; l--) {
+		pte = &page_table[PX(va, l)];
 		if (*pte & PTE_V) {
+			if (PTE_LEAF(*pte)) {
+				*level = l;
+				return pte;
+			}
 			page_table = (pte_t *)PTE2PA(*pte);
 		} else if (alloc) {
 			page_table = pm_zalloc();
@@ -85,13 +520,103 @@ pte_t *walk(pte_t *page_table, uint64_t va, bool alloc)
 			return NULL;
 		}
 	}
-	return &page_table[PX(va, 0)];
+	return &page_table[PX(va, *level)];
+}
+
+pte_t *walk(pte_t *page_table, uint64_t va, bool alloc)
+{
+	int level = 0;
+	return walk_level(page_table, va, &level, alloc);
+}
+
+/* Pages from va up to end or the end of its last-level page table. */
+static size_t span_pages(uint64_t va, uint64_t end)
+{
+	uint64_t next = (va | (LEVEL_SIZE(1) - 1)) + 1;
+
+	end = PAGE_ROUND_UP(end);
+	if (next > end)
+		next = end;
+	return (next - va) / PAGE_SIZE;
+}
+
+/*
+ * Like walk(), but also set *n to the number of PTEs from the one of
+ * va that lie in the same last-level page table and below end.  Ranges
+ * are walked a page table at a time this way, which takes one walk
+ * and at most one allocation per 2 MiB.  If NULL is returned, *n still
+ * counts the pages of the missing table.  Superpages are not expected.
+ */
+pte_t *walk_span(pte_t *page_table, uint64_t va, uint64_t end, bool alloc,
+		 size_t *n)
+{
+	int level = 0;
+	pte_t *pte;
+
+	*n = span_pages(va, end);
+	pte = walk_level(page_table, va, &level, alloc);
+	if (pte && level > 0)
+		panic("walk_span: superpage");
+	return pte;
+}
+
+/*
+ * A PTE of page_table at va lost its page or a permission.  Only the
+ * running process can have cached it under its ASID: other page tables
+ * are either not run yet, or dead, or replaced and their ASID dropped.
+ */
+static void tlb_flush_page(pte_t *page_table, uint64_t va)
+{
+	struct process *p = running_proc();
+	if (p && p->page_table == page_table)
+		asid_flush_page(p, va);
+}
+
+/*
+ * Count user pages mapped into or out of page_table.  Like the TLB,
+ * only the running process's count needs to follow: fork and exec set
+ * the count of the page tables they build themselves.
+ */
+static void uvm_account(pte_t *page_table, int64_t pages)
+{
+	struct process *p = running_proc();
+	if (p && p->page_table == page_table)
+		p->rss += pages;
 }
 
+/*
+ * The largest level whose leaf can map va to pa with size bytes left,
+ * without replacing a page table that already maps part of it.
+ */
+static int map_level(pte_t *page_table, uint64_t va, uint64_t pa,
+		     size_t size)
+{
+	int level, l;
+	pte_t *pte;
+
+	for (level = 2; level > 0; level--) {
+		if (va % LEVEL_SIZE(level) != 0 || pa % LEVEL_SIZE(level) != 0 ||
+		    size < LEVEL_SIZE(level))
+			continue;
+		l = level;
+		pte = walk_level(page_table, va, &l, false);
+		if (!pte || !(*pte & PTE_V) || PTE_LEAF(*pte))
+			return level;
+	}
+	return 0;
+}
+
+/*
+ * Map [va, va + size) to pa.  Where va and pa are aligned alike,
+ * 2 MiB and 1 GiB superpages are used, so that large ranges such as
+ * the kernel's direct map need few page-table pages and TLB entries.
+ */
 int map_pages(pte_t *page_table, uint64_t va, uint64_t pa, size_t size,
 	      uint64_t perm)
 {
 	uint64_t cur_va, last;
+	size_t i, n;
+	int level;
 	pte_t *pte;
 
 	if ((va % PAGE_SIZE) != 0)
@@ -104,16 +629,26 @@ int map_pages(pte_t *page_table, uint64_t va, uint64_t pa, size_t size,
 	cur_va = va;
 	last = va + size;
 	while (cur_va < last) {
-		pte = walk(page_table, cur_va, true);
+		level = map_level(page_table, cur_va, pa, last - cur_va);
+		if (level > 0) {
+			pte = walk_level(page_table, cur_va, &level, true);
+			n = 1;
+		} else {
+			pte = walk_span(page_table, cur_va, last, true, &n);
+		}
 		if (!pte) {
 			unmap_pages(page_table, va, cur_va - va, false);
 			return -1;
 		}
-		if (*pte & PTE_V)
-			panic("remapping");
-		*pte = PA2PTE(pa) | PTE_V | perm;
-		cur_va += PAGE_SIZE;
-		pa += PAGE_SIZE;
+		for (i = 0; i < n; i++) {
+			if (pte[i] & PTE_V)
+				panic("remapping");
+			pte[i] = PA2PTE(pa) | PTE_V | perm;
+			cur_va += LEVEL_SIZE(level);
+			pa += LEVEL_SIZE(level);
+		}
+		if (perm & PTE_U)
+			uvm_account(page_table, n);
 	}
 	return 0;
 }
@@ -121,6 +656,8 @@ int map_pages(pte_t *page_table, uint64_t va, uint64_t pa, size_t size,
 void unmap_pages(pte_t *page_table, uint64_t va, size_t size, bool free)
 {
 	uint64_t cur_va, last;
+	size_t i, n;
+	int level;
 	pte_t *pte;
 
 	if ((va % PAGE_SIZE) != 0)
@@ -131,17 +668,54 @@ void unmap_pages(pte_t *page_table, uint64_t va, size_t size, bool free)
 	cur_va = va;
 	last = va + size;
 	while (cur_va < last) {
-		pte = walk(page_table, cur_va, false);
+		level = 0;
+		pte = walk_level(page_table, cur_va, &level, false);
 		if (!pte)
 			panic("walk invalid PTE");
-		if ((*pte & PTE_V) == 0)
-			panic("unmapped page");
-		if (PTE_FLAGS(*pte) == PTE_V)
-			panic("not a leaf");
-		if (free)
-			pm_free((void *)PTE2PA(*pte));
-		*pte = 0;
-		cur_va += PAGE_SIZE;
+		/* Superpages are never freed and only unmapped whole. */
+		if (level > 0 && (free || cur_va % LEVEL_SIZE(level) != 0 ||
+				  last - cur_va < LEVEL_SIZE(level)))
+			panic("unmap part of a superpage");
+		n = level > 0 ? 1 : span_pages(cur_va, last);
+		for (i = 0; i < n; i++, pte++) {
+			if ((*pte & PTE_V) == 0)
+				panic("unmapped page");
+			if (PTE_FLAGS(*pte) == PTE_V)
+				panic("not a leaf");
+			if (free)
+				pm_free((void *)PTE2PA(*pte));
+			if (*pte & PTE_U)
+				uvm_account(page_table, -1);
+			*pte = 0;
+			tlb_flush_page(page_table, cur_va);
+			cur_va += LEVEL_SIZE(level);
+		}
+	}
+}
+
+/*
+ * Unmap and free the user pages in [va, va + size).
+ * Unlike unmap_pages(), pages that were never populated are skipped.
+ */
+void uvm_unmap(pte_t *page_table, uint64_t va, size_t size)
+{
+	uint64_t a;
+	size_t i, n;
+	pte_t *pte;
+
+	for (a = va; a < va + size; a += n * PAGE_SIZE) {
+		if (!(pte = walk_span(page_table, a, va + size, false, &n)))
+			continue;
+		for (i = 0; i < n; i++) {
+			if (!(pte[i] & PTE_V))
+				continue;
+			if (PTE_FLAGS(pte[i]) == PTE_V)
+				panic("not a leaf");
+			pm_free((void *)PTE2PA(pte[i]));
+			pte[i] = 0;
+			tlb_flush_page(page_table, a + i * PAGE_SIZE);
+			uvm_account(page_table, -1);
+		}
 	}
 }
 
@@ -166,7 +740,6 @@ static void free_page_table(pte_t *page_table)
 pte_t *get_user_page_table(struct process *p)
 {
 	pte_t *page_table;
-	void *ustack;
 
 	if (!(page_table = pm_zalloc()))
 		return 0;
@@ -179,19 +752,10 @@ pte_t *get_user_page_table(struct process *p)
 	if (map_pages(page_table, TRAP_FRAME, (uint64_t)(p->tf), PAGE_SIZE,
 		      PTE_R | PTE_W) != 0)
 		goto bad1;
-	/* user stack */
-	if ((ustack = pm_alloc()) == 0)
-		goto bad2;
-	if (map_pages(page_table, USER_STACK_BASE, (uint64_t)ustack, PAGE_SIZE,
-		      PTE_U | PTE_W | PTE_R) != 0)
-		goto bad3;
+	/* The user stack is populated by uvm_fault(). */
 
 	return page_table;
 
-bad3:
-	pm_free(ustack);
-bad2:
-	unmap_pages(page_table, TRAP_FRAME, PAGE_SIZE, false);
 bad1:
 	unmap_pages(page_table, TRAMPOLINE, PAGE_SIZE, false);
 bad0:
@@ -201,64 +765,234 @@ bad0:
 
 void free_user_page_table(pte_t *page_table, size_t size)
 {
-	unmap_pages(page_table, USER_STACK_BASE, PAGE_SIZE, true);
+	uvm_unmap(page_table, USER_STACK_BASE, USER_STACK_SIZE);
 	unmap_pages(page_table, TRAP_FRAME, PAGE_SIZE, false);
 	unmap_pages(page_table, TRAMPOLINE, PAGE_SIZE, false);
 	uvm_free(page_table, size);
 }
 
-static void copy_user_stack(pte_t *dst, pte_t *src)
+/*
+ * Share the user pages in [start, end) of src with dst.  With cow,
+ * writable pages become read-only copy-on-write pages in both page
+ * tables, and are copied by cow_copy() on the first store from either
+ * side.
+ */
+int uvm_copy(pte_t *dst, pte_t *src, uint64_t start, uint64_t end, bool cow)
 {
-	uint64_t dst_stack = uvm_walk_addr(dst, USER_STACK_BASE);
-	uint64_t src_stack = uvm_walk_addr(src, USER_STACK_BASE);
-	memmove((void *)dst_stack, (void *)src_stack, PAGE_SIZE);
+	uint64_t va;
+	size_t i, n;
+	pte_t *s, *d;
+
+	for (va = start; va < end; va += n * PAGE_SIZE) {
+		if (!(s = walk_span(src, va, end, false, &n)))
+			continue;
+		d = NULL;
+		for (i = 0; i < n; i++) {
+			/* Pages never touched stay unmapped in both. */
+			if (!(s[i] & PTE_V))
+				continue;
+			if (!d && !(d = walk_span(dst, va, end, true, &n)))
+				goto bad;
+			if (d[i] & PTE_V)
+				panic("remapping");
+			if (cow && (s[i] & PTE_W)) {
+				s[i] = (s[i] & ~PTE_W) | PTE_COW;
+				tlb_flush_page(src, va + i * PAGE_SIZE);
+			}
+			d[i] = s[i];
+			pm_dup((void *)PTE2PA(s[i]));
+		}
+	}
+	return 0;
+
+bad:
+	uvm_unmap(dst, start, va - start);
+	return -1;
 }
 
 int copy_user_page_table(pte_t *dst, pte_t *src, size_t size)
+{
+	if (uvm_copy(dst, src, 0, size, true))
+		return -1;
+	if (uvm_copy(dst, src, USER_STACK_BASE, USER_STACK_TOP, true)) {
+		uvm_unmap(dst, 0, PAGE_ROUND_UP(size));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Give the page table its own writable copy of a copy-on-write page.
+ * The last sharer takes the page over without copying.
+ */
+static int cow_copy(pte_t *pte)
 {
 	void *mem;
+	uint64_t pa, flags;
+
+	pa = PTE2PA(*pte);
+	flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+	if (pm_refcnt((void *)pa) == 1) {
+		*pte = PA2PTE(pa) | flags;
+		return 0;
+	}
+	if (!(mem = pm_alloc()))
+		return -1;
+	page_copy(mem, (void *)pa);
+	*pte = PA2PTE(mem) | flags;
+	pm_free((void *)pa);
+	return 0;
+}
+
+/*
+ * Handle a page fault of a user process at va.  access is PTE_R,
+ * PTE_W or PTE_X.  Return 0 if the access can be retried.
+ */
+int uvm_fault(struct process *p, uint64_t va, uint64_t access)
+{
 	pte_t *pte;
-	uint64_t pa, va, flag;
+	void *mem;
+	struct vma *v;
+	bool write = access == PTE_W;
 
-	for (va = 0; va < size; va += PAGE_SIZE) {
-		if (!(pte = walk(src, va, false)))
-			panic("walk invalid PTE");
-		if (!(*pte & PTE_V))
-			panic("page not present");
-		pa = PTE2PA(*pte);
-		flag = PTE_FLAGS(*pte);
-		if (!(mem = pm_alloc()))
-			goto failed;
-		memmove(mem, (const void *)pa, PAGE_SIZE);
-		if ((map_pages(dst, va, (uint64_t)mem, PAGE_SIZE, flag))) {
-			pm_free(mem);
-			goto failed;
+	if (va >= MAX_VADDR)
+		return -1;
+	va = PAGE_ROUND_DOWN(va);
+	pte = walk(p->page_table, va, false);
+	v = vma_find(p->vmas, va);
+	if (pte && (*pte & PTE_V)) {
+		if (!(*pte & PTE_U))
+			return -1;
+		/*
+		 * New and upgraded PTEs are not flushed, so the TLB may
+		 * still hold what was there before.
+		 */
+		if (*pte & access) {
+			asid_flush_page(p, va);
+			return 0;
+		}
+		if (write && (*pte & PTE_COW)) {
+			if (cow_copy(pte))
+				return -1;
+			asid_flush_page(p, va);
+			return 0;
 		}
+		if (v)
+			return vma_fault(p->page_table, v, va, write);
+		return -1;
 	}
 
-	copy_user_stack(dst, src);
+	if (v)
+		return vma_fault(p->page_table, v, va, write);
 
+	/*
+	 * The heap and the stack are populated with zeroed pages on first
+	 * touch.  Below the stack lies the guard region, which stays
+	 * unmapped.
+	 */
+	if (va >= p->size && (va < USER_STACK_BASE || va >= USER_STACK_TOP))
+		return -1;
+	if (!(mem = pm_zalloc()))
+		return -1;
+	if (map_pages(p->page_table, va, (uint64_t)mem, PAGE_SIZE,
+		      PTE_R | PTE_W | PTE_U)) {
+		pm_free(mem);
+		return -1;
+	}
 	return 0;
+}
 
-failed:
-	unmap_pages(dst, 0, va, true);
-	return -1;
+/*
+ * Return the PTE of the user page at va if it allows the access.
+ * Pages of the running process that are not populated yet, or are
+ * not writable yet, are resolved through uvm_fault() first, unless a
+ * spin lock is held: a fault may read the page from a file.
+ */
+static pte_t *uvm_walk_pte(pte_t *page_table, uint64_t va, bool write)
+{
+	struct process *p = running_proc();
+	bool locked;
+	pte_t *pte;
+
+	if (va >= MAX_VADDR)
+		return NULL;
+	pte = walk(page_table, va, false);
+	if ((!pte || !(*pte & PTE_V) || (write && !(*pte & PTE_W))) && p &&
+	    p->page_table == page_table) {
+		push_off();
+		locked = current_cpu()->n_off > 1;
+		pop_off();
+		if (locked || uvm_fault(p, va, write ? PTE_W : PTE_R))
+			return NULL;
+		pte = walk(page_table, va, false);
+	}
+	if (!pte || !(*pte & PTE_V) || !(*pte & PTE_U))
+		return NULL;
+	if (write && !(*pte & PTE_W))
+		return NULL;
+	return pte;
+}
+
+/*
+ * Translate as much of the user range [va, va + n) as is physically
+ * contiguous, checking the PTEs after the first one in its page table
+ * without walking again.  Return the kernel address of va and set
+ * *len to the length of the run, or return NULL if va is not
+ * accessible.
+ */
+static void *uvm_span(pte_t *page_table, uint64_t va, size_t n, bool write,
+		      size_t *len)
+{
+	uint64_t page, pa, need;
+	size_t i, span;
+	pte_t *pte;
+
+	page = PAGE_ROUND_DOWN(va);
+	if (!(pte = uvm_walk_pte(page_table, page, write)))
+		return NULL;
+	pa = PTE2PA(*pte);
+	*len = PAGE_SIZE - (va - page);
+	need = PTE_V | PTE_U | (write ? PTE_W : PTE_R);
+	span = span_pages(page, va + n);
+	for (i = 1; i < span && *len < n; i++) {
+		if ((pte[i] & need) != need ||
+		    PTE2PA(pte[i]) != pa + i * PAGE_SIZE)
+			break;
+		*len += PAGE_SIZE;
+	}
+	if (*len > n)
+		*len = n;
+	return (void *)(pa + (va - page));
+}
+
+/*
+ * Populate the user range [va, va + n) of the running process for
+ * copy_in(), or copy_out() if write, so that copying it under a spin
+ * lock does not fault.
+ */
+int uvm_prefault(uint64_t va, size_t n, bool write)
+{
+	pte_t *page_table = running_proc()->page_table;
+	uint64_t a;
+
+	if (va + n < va)
+		return -1;
+	for (a = PAGE_ROUND_DOWN(va); a < va + n; a += PAGE_SIZE) {
+		if (!uvm_walk_pte(page_table, a, write))
+			return -1;
+	}
+	return 0;
 }
 
 int copy_in(pte_t *page_table, void *dst, uint64_t src, size_t n)
 {
-	uint64_t va, pa;
 	size_t len;
+	void *s;
 
 	while (n > 0) {
-		va = PAGE_ROUND_DOWN(src);
-		pa = uvm_walk_addr(page_table, va);
-		if (!pa)
+		if (!(s = uvm_span(page_table, src, n, false, &len)))
 			return -1;
-		len = PAGE_SIZE - (src - va);
-		if (len > n)
-			len = n;
-		memmove(dst, (void *)(pa + (src - va)), len);
+		memmove(dst, s, len);
 		n -= len;
 		dst += len;
 		src += len;
@@ -268,23 +1002,13 @@ int copy_in(pte_t *page_table, void *dst, uint64_t src, size_t n)
 
 int copy_out(pte_t *page_table, uint64_t dst, void *src, size_t n)
 {
-	uint64_t va, pa;
 	size_t len;
-	pte_t *pte;
+	void *d;
 
 	while (n > 0) {
-		va = PAGE_ROUND_DOWN(dst);
-		if (va >= MAX_VADDR)
+		if (!(d = uvm_span(page_table, dst, n, true, &len)))
 			return -1;
-		pte = walk(page_table, va, false);
-		if (!pte || !(*pte & PTE_V) || !(*pte & PTE_U) ||
-		    !(*pte & PTE_W))
-			return -1;
-		pa = PTE2PA(*pte);
-		len = PAGE_SIZE - (dst - va);
-		if (len > n)
-			len = n;
-		memmove((void *)(pa + (dst - va)), src, len);
+		memmove(d, src, len);
 		n -= len;
 		src += len;
 		dst += len;
@@ -294,57 +1018,40 @@ int copy_out(pte_t *page_table, uint64_t dst, void *src, size_t n)
 
 int copy_str_in(pte_t *page_table, char *dst, uint64_t src, size_t max_len)
 {
-	uint64_t va, pa;
-	size_t len;
+	size_t len, i;
 	char *s;
 
 	while (max_len > 0) {
-		va = PAGE_ROUND_DOWN(src);
-		pa = uvm_walk_addr(page_table, va);
-		if (pa == 0)
+		if (!(s = uvm_span(page_table, src, max_len, false, &len)))
 			return -1;
-		len = PAGE_SIZE - (src - va);
-		if (len > max_len)
-			len = max_len;
-		s = (char *)(pa + (src - va));
-		for (; len > 0; len--) {
-			*dst = *s;
-			if (*s == 0)
+		for (i = 0; i < len; i++) {
+			dst[i] = s[i];
+			if (s[i] == 0)
 				return 0;
-			dst++;
-			s++;
 		}
 		max_len -= len;
+		dst += len;
+		src += len;
 	}
 	return 0;
 }
 
 int copy_str_out(pte_t *page_table, uint64_t dst, char *src, size_t max_len)
 {
-	uint64_t va, pa;
-	size_t len;
-	char *s;
-	pte_t *pte;
+	size_t len, i;
+	char *d;
 
 	while (max_len > 0) {
-		va = PAGE_ROUND_DOWN(dst);
-		pte = walk(page_table, va, false);
-		if (!pte || !(*pte & PTE_V) || !(*pte & PTE_U) ||
-		    !(*pte & PTE_W))
+		if (!(d = uvm_span(page_table, dst, max_len, true, &len)))
 			return -1;
-		pa = PTE2PA(*pte);
-		len = PAGE_SIZE - (dst - va);
-		if (len > max_len)
-			len = max_len;
-		s = (char *)(pa + (dst - va));
-		for (; len > 0; len--) {
-			*s = *src;
-			if (*src == 0)
+		for (i = 0; i < len; i++) {
+			d[i] = src[i];
+			if (src[i] == 0)
 				return 0;
-			s++;
-			src++;
 		}
 		max_len -= len;
+		src += len;
+		dst += len;
 	}
 	return 0;
 }
@@ -369,20 +1076,6 @@ int either_copy_in(bool from_user, void *dst, uint64_t src, size_t n)
 	}
 }
 
-static void map_kernel_stacks(pte_t *page_table)
-{
-	uint32_t i;
-	uint64_t va, pa;
-	for (i = 0; i < N_PROC; i++) {
-		pa = (uint64_t)pm_alloc();
-		if (!pa)
-			panic("no free page");
-		va = KERNEL_STACK(i);
-		if (map_pages(page_table, va, pa, PAGE_SIZE, PTE_R | PTE_W))
-			panic("mapping failed");
-	}
-}
-
 static void kvm_map(pte_t *page_table, uint64_t va, uint64_t pa, size_t size,
 		    uint64_t perm)
 {
@@ -411,15 +1104,99 @@ static pte_t *kvm_make(void)
 	/* trampoline */
 	kvm_map(page_table, TRAMPOLINE, (uint64_t)trampoline, PAGE_SIZE,
 		PTE_R | PTE_X);
-	/* kernel stacks */
-	map_kernel_stacks(page_table);
+	/* kernel stacks are mapped by kvm_map_stack() */
 
 	return page_table;
 }
 
+/*
+ * Count the page-table pages of a tree, and the ones it would take if
+ * its 2 MiB and 1 GiB leaves were split into 4 KiB pages.
+ */
+static void count_page_tables(pte_t *page_table, int level, size_t *used,
+			      size_t *flat)
+{
+	uint32_t i;
+	pte_t pte;
+
+	(*used)++;
+	(*flat)++;
+	for (i = 0; i < 512; i++) {
+		pte = page_table[i];
+		if (!(pte & PTE_V))
+			continue;
+		if (!PTE_LEAF(pte))
+			count_page_tables((pte_t *)PTE2PA(pte), level - 1, used,
+					  flat);
+		else if (level == 2)
+			*flat += 1 + 512;
+		else if (level == 1)
+			*flat += 1;
+	}
+}
+
 void kvm_init(void)
 {
+	size_t used = 0, flat = 0;
+
 	kernel_page_table = kvm_make();
+	count_page_tables(kernel_page_table, 2, &used, &flat);
+	printk("kvm: %lu page-table pages, %lu with 4 KiB pages only\n", used,
+	       flat);
+}
+
+/*
+ * Map new pages at the kernel stack va, for a process that takes a new
+ * stack slot, and leave the guard below it unmapped.  Pages mapped by
+ * an earlier failed attempt are kept.  Return 0, or -1 if out of
+ * memory.
+ */
+int kvm_map_stack(uint64_t va)
+{
+	uint64_t a;
+	pte_t *pte;
+	void *mem;
+
+	for (a = va; a < va + KERNEL_STACK_SIZE; a += PAGE_SIZE) {
+		pte = walk(kernel_page_table, a, false);
+		if (pte && (*pte & PTE_V))
+			continue;
+		if (!(mem = pm_alloc()))
+			return -1;
+		if (map_pages(kernel_page_table, a, (uint64_t)mem, PAGE_SIZE,
+			      PTE_R | PTE_W)) {
+			pm_free(mem);
+			return -1;
+		}
+	}
+	/* Every hart shares the kernel page table. */
+	sbi_remote_sfence_vma((1ul << N_CPU) - 1, va, KERNEL_STACK_SIZE);
+	return 0;
+}
+
+/*
+ * Unmap the kernel stack at va of an unused process and free its pages
+ * once no hart can reach them through its TLB.  Return how many pages
+ * were freed.
+ */
+size_t kvm_unmap_stack(uint64_t va)
+{
+	void *pages[KERNEL_STACK_SIZE / PAGE_SIZE];
+	size_t i, n = 0;
+	uint64_t a;
+	pte_t *pte;
+
+	for (a = va; a < va + KERNEL_STACK_SIZE; a += PAGE_SIZE) {
+		pte = walk(kernel_page_table, a, false);
+		if (pte && (*pte & PTE_V)) {
+			pages[n++] = (void *)PTE2PA(*pte);
+			*pte = 0;
+		}
+	}
+	sbi_remote_sfence_vma((1ul << N_CPU) - 1, va, KERNEL_STACK_SIZE);
+	for (i = 0; i < n; i++)
+		pm_free(pages[i]);
+	return n;
 }
 
 void kvm_init_hart(void)
@@ -433,25 +1210,31 @@ uint64_t uvm_alloc(pte_t *page_table, uint64_t old_sz, uint64_t new_sz,
 		   uint64_t xperm)
 {
 	uint64_t a;
+	size_t i, n;
 	void *mem;
+	pte_t *pte;
 
 	if (new_sz <= old_sz)
 		return old_sz;
 	old_sz = PAGE_ROUND_UP(old_sz);
-	for (a = old_sz; a < new_sz; a += PAGE_SIZE) {
-		mem = pm_zalloc();
-		if (!mem) {
-			uvm_dealloc(page_table, a, old_sz);
-			return 0;
-		}
-		if (map_pages(page_table, a, (uint64_t)mem, PAGE_SIZE,
-			      PTE_R | PTE_U | xperm)) {
-			pm_free(mem);
-			uvm_dealloc(page_table, a, old_sz);
-			return 0;
+	a = old_sz;
+	while (a < new_sz) {
+		if (!(pte = walk_span(page_table, a, new_sz, true, &n)))
+			goto bad;
+		for (i = 0; i < n; i++, a += PAGE_SIZE) {
+			if (!(mem = pm_zalloc()))
+				goto bad;
+			if (pte[i] & PTE_V)
+				panic("remapping");
+			pte[i] = PA2PTE(mem) | PTE_V | PTE_R | PTE_U | xperm;
+			uvm_account(page_table, 1);
 		}
 	}
 	return new_sz;
+
+bad:
+	uvm_dealloc(page_table, a, old_sz);
+	return 0;
 }
 
 uint64_t uvm_dealloc(pte_t *page_table, uint64_t old_sz, uint64_t new_sz)
@@ -460,14 +1243,14 @@ uint64_t uvm_dealloc(pte_t *page_table, uint64_t old_sz, uint64_t new_sz)
 		return old_sz;
 	old_sz = PAGE_ROUND_UP(old_sz);
 	new_sz = PAGE_ROUND_UP(new_sz);
-	unmap_pages(page_table, new_sz, old_sz - new_sz, true);
+	uvm_unmap(page_table, new_sz, old_sz - new_sz);
 	return new_sz;
 }
 
 void uvm_free(pte_t *page_table, size_t size)
 {
 	if (size > 0)
-		unmap_pages(page_table, 0, PAGE_ROUND_UP(size), true);
+		uvm_unmap(page_table, 0, PAGE_ROUND_UP(size));
 	free_page_table(page_table);
 }
 
@@ -0,0 +1,278 @@
+#include "mm/page_cache.h"
+#include "fs/inode.h"
+#include "lib/string.h"
+#include "lock.h"
+#include "mm/mm.h"
+#include "mm/shrinker.h"
+#include "mm/slab.h"
+#include "param.h"
+#include "printk.h"
+#include "riscv.h"
+
+/*
+ * Cache of file pages, such as program text or MAP_SHARED mappings, so
+ * that every process mapping the same file maps the same physical pages.
+ *
+ * A page is identified by (dev, ino, off, len): len is the number of
+ * bytes read from the file at off, the rest of the page is zero.
+ * The cache holds one reference to each page, and every page table
+ * mapping it holds another, so a page with a single reference is
+ * only kept by the cache.
+ *
+ * Entries come from a slab cache.  Pages that processes map always
+ * keep theirs, since writei() updates the cached pages in place; only
+ * beyond N_PCACHE entries are unmapped pages evicted to make room.
+ */
+
+#define N_PCACHE_BUCKETS 64
+
+struct cached_page {
+	uint32_t dev;
+	uint32_t ino;
+	uint32_t off;
+	uint32_t len;
+	void *page;
+	struct cached_page *next;
+};
+
+struct page_cache {
+	struct spin_lock lock;
+	struct slab_cache cache;
+	/* Chains of entries, hashed by (dev, ino) */
+	struct cached_page *buckets[N_PCACHE_BUCKETS];
+	uint32_t count; /* Entries in the chains */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+static struct page_cache pcache;
+
+#define HASH(dev, ino) (((dev) * 31 + (ino)) % N_PCACHE_BUCKETS)
+
+static size_t page_cache_shrink(size_t nr);
+
+static struct shrinker page_cache_shrinker = {
+	.name = "page_cache",
+	.shrink = page_cache_shrink,
+};
+
+void page_cache_init(void)
+{
+	spin_lock_init(&pcache.lock, "page_cache");
+	slab_cache_init(&pcache.cache, "page_cache", sizeof(struct cached_page),
+			NULL);
+	shrinker_register(&page_cache_shrinker);
+}
+
+/*
+ * Unlink up to nr entries whose page no process maps any more and free
+ * their pages.  Return the entries, chained through next, for the
+ * caller to free after dropping pcache.lock.
+ */
+static struct cached_page *evict(size_t nr)
+{
+	struct cached_page **pp, *e, *evicted = NULL;
+	uint32_t h;
+
+	for (h = 0; h < N_PCACHE_BUCKETS && nr > 0; h++) {
+		pp = &pcache.buckets[h];
+		while ((e = *pp) && nr > 0) {
+			if (pm_refcnt(e->page) != 1) {
+				pp = &e->next;
+				continue;
+			}
+			*pp = e->next;
+			pm_free(e->page);
+			e->next = evicted;
+			evicted = e;
+			pcache.count--;
+			pcache.evictions++;
+			nr--;
+		}
+	}
+	return evicted;
+}
+
+static void free_entries(struct cached_page *e)
+{
+	struct cached_page *next;
+
+	for (; e; e = next) {
+		next = e->next;
+		slab_free(&pcache.cache, e);
+	}
+}
+
+/* Drop up to nr pages that no process maps any more. */
+static size_t page_cache_shrink(size_t nr)
+{
+	struct cached_page *evicted, *e;
+	size_t n = 0;
+
+	spin_lock_acquire(&pcache.lock);
+	evicted = evict(nr);
+	spin_lock_release(&pcache.lock);
+	for (e = evicted; e; e = e->next)
+		n++;
+	free_entries(evicted);
+	return n + slab_shrink(&pcache.cache);
+}
+
+/* Must be called with pcache.lock held. */
+static struct cached_page *find_entry(struct m_inode *inode, uint32_t off,
+				      uint32_t len)
+{
+	struct cached_page *e;
+
+	e = pcache.buckets[HASH(inode->dev, inode->ino)];
+	for (; e; e = e->next) {
+		if (e->dev == inode->dev && e->ino == inode->ino &&
+		    e->off == off && e->len == len)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Return the cached page with a new reference for the caller.  Like
+ * page_cache_insert(), must be called with the inode locked, so that
+ * no write to the file comes in between.
+ */
+void *page_cache_lookup(struct m_inode *inode, uint32_t off, uint32_t len)
+{
+	struct cached_page *e;
+	void *page = NULL;
+
+	spin_lock_acquire(&pcache.lock);
+	if ((e = find_entry(inode, off, len))) {
+		page = e->page;
+		pm_dup(page);
+		pcache.hits++;
+	} else {
+		pcache.misses++;
+	}
+	spin_lock_release(&pcache.lock);
+	return page;
+}
+
+/*
+ * Offer a page just read from the locked inode to the cache.  If the
+ * same page is cached already, the caller's page is dropped and the
+ * cached one is returned instead.  Either way the caller owns one
+ * reference to the returned page.  Return NULL, leaving the page to
+ * the caller, if there is no memory to cache it.
+ */
+void *page_cache_insert(struct m_inode *inode, uint32_t off, uint32_t len,
+			void *page)
+{
+	struct cached_page *e, *new, *evicted = NULL;
+	void *cached;
+	uint32_t h;
+
+	/* Allocate unlocked, reclaim may shrink the cache. */
+	new = slab_alloc(&pcache.cache);
+	spin_lock_acquire(&pcache.lock);
+	if ((e = find_entry(inode, off, len))) {
+		cached = e->page;
+		pm_dup(cached);
+		spin_lock_release(&pcache.lock);
+		pm_free(page);
+		if (new)
+			slab_free(&pcache.cache, new);
+		return cached;
+	}
+	if (!new) {
+		spin_lock_release(&pcache.lock);
+		return NULL;
+	}
+	if (pcache.count >= N_PCACHE)
+		evicted = evict(1);
+	new->dev = inode->dev;
+	new->ino = inode->ino;
+	new->off = off;
+	new->len = len;
+	new->page = page;
+	pm_dup(page);
+	h = HASH(new->dev, new->ino);
+	new->next = pcache.buckets[h];
+	pcache.buckets[h] = new;
+	pcache.count++;
+	spin_lock_release(&pcache.lock);
+	free_entries(evicted);
+	return page;
+}
+
+/*
+ * Copy n bytes just written to the locked inode at off into the cached
+ * pages they fall in, so that every process mapping one sees them.
+ */
+void page_cache_write(struct m_inode *inode, uint32_t off, const void *src,
+		      uint32_t n)
+{
+	struct cached_page *e;
+	uint64_t end = (uint64_t)off + n, from, to;
+
+	spin_lock_acquire(&pcache.lock);
+	e = pcache.buckets[HASH(inode->dev, inode->ino)];
+	for (; e; e = e->next) {
+		if (e->dev != inode->dev || e->ino != inode->ino ||
+		    e->off >= end || off >= (uint64_t)e->off + PAGE_SIZE)
+			continue;
+		from = off > e->off ? off : e->off;
+		to = end < (uint64_t)e->off + PAGE_SIZE ? end
+						       : e->off + PAGE_SIZE;
+		memmove((char *)e->page + (from - e->off),
+			(const char *)src + (from - off), to - from);
+		/* A write past the end of the file grows the page. */
+		if (to - e->off > e->len)
+			e->len = to - e->off;
+	}
+	spin_lock_release(&pcache.lock);
+}
+
+/*
+ * Forget the pages of an inode that overlap [off, off + len) because
+ * the file no longer has them.  Processes that map them keep their
+ * copies.
+ */
+void page_cache_invalidate(struct m_inode *inode, uint32_t off,
+			   uint32_t len)
+{
+	struct cached_page **pp, *e, *freed = NULL;
+	uint64_t end = (uint64_t)off + len;
+
+	spin_lock_acquire(&pcache.lock);
+	pp = &pcache.buckets[HASH(inode->dev, inode->ino)];
+	while ((e = *pp)) {
+		if (e->dev == inode->dev && e->ino == inode->ino &&
+		    e->off < end && off < (uint64_t)e->off + PAGE_SIZE) {
+			*pp = e->next;
+			pm_free(e->page);
+			e->next = freed;
+			freed = e;
+			pcache.count--;
+		} else {
+			pp = &e->next;
+		}
+	}
+	spin_lock_release(&pcache.lock);
+	free_entries(freed);
+}
+
+void page_cache_dump(void)
+{
+	struct cached_page *e;
+	uint32_t h, used = 0, mapped = 0;
+
+	for (h = 0; h < N_PCACHE_BUCKETS; h++) {
+		for (e = pcache.buckets[h]; e; e = e->next) {
+			used++;
+			if (pm_refcnt(e->page) > 1)
+				mapped++;
+		}
+	}
+	printk("page cache: %u pages (%u mapped), %lu hits, %lu misses, "
+	       "%lu evictions\n",
+	       used, mapped, pcache.hits, pcache.misses, pcache.evictions);
+}
@@ -0,0 +1,249 @@
+#include "mm/slab.h"
+#include "mm/mm.h"
+#include "mm/shrinker.h"
+#include "printk.h"
+#include "riscv.h"
+#include "sched/cpu.h"
+
+/*
+ * A slab is one page from pm_alloc(): a struct slab followed by the
+ * objects.  Each object is followed by a link for the free list of its
+ * slab, so that a free object keeps what its constructor set up.
+ *
+ * Objects freed on a hart go to its struct slab_cpu first and are
+ * handed out again from there without taking the cache lock.  Only
+ * when that runs empty or full are objects moved to or from the slabs
+ * in batches.  A cache keeps at most one slab without objects in use;
+ * slab_shrink() releases that one too.
+ */
+
+struct slab {
+	struct slab *prev;
+	struct slab *next;
+	void *free;	 /* Free objects of this slab */
+	uint32_t in_use; /* Objects not on the free list */
+};
+
+#define SLAB_HEADER ((sizeof(struct slab) + 7) & ~7ul)
+#define STRIDE(c) ((c)->size + sizeof(void *))
+#define LINK(c, obj) (*(void **)((uint8_t *)(obj) + (c)->size))
+#define SLAB_OF(obj) ((struct slab *)PAGE_ROUND_DOWN((uint64_t)(obj)))
+
+static struct spin_lock caches_lock = {
+	.cpuid = -1,
+	.name = "slab_caches",
+};
+static struct slab_cache *caches;
+
+static size_t slab_reclaim(size_t nr);
+
+static struct shrinker slab_shrinker = {
+	.name = "slab",
+	.shrink = slab_reclaim,
+};
+
+void slab_cache_init(struct slab_cache *c, const char *name, size_t size,
+		     void (*ctor)(void *obj))
+{
+	c->name = name;
+	c->size = (size + 7) & ~7ul;
+	if (SLAB_HEADER + STRIDE(c) > PAGE_SIZE)
+		panic("slab object too large");
+	c->per_slab = (PAGE_SIZE - SLAB_HEADER) / STRIDE(c);
+	c->ctor = ctor;
+	spin_lock_init(&c->lock, name);
+
+	spin_lock_acquire(&caches_lock);
+	if (!caches)
+		shrinker_register(&slab_shrinker);
+	c->next = caches;
+	caches = c;
+	spin_lock_release(&caches_lock);
+}
+
+static void slab_list_add(struct slab **list, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = *list;
+	if (*list)
+		(*list)->prev = s;
+	*list = s;
+}
+
+static void slab_list_del(struct slab **list, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+/*
+ * Add a new slab.  Must be called with c->lock held, which is dropped
+ * around pm_alloc(): under memory pressure, pm_alloc() runs the slab
+ * shrinker, which takes the lock of every cache.
+ */
+static struct slab *slab_grow(struct slab_cache *c)
+{
+	struct slab *s;
+	uint8_t *obj;
+	uint32_t i;
+
+	spin_lock_release(&c->lock);
+	s = pm_alloc();
+	spin_lock_acquire(&c->lock);
+	if (!s)
+		return NULL;
+	s->free = NULL;
+	s->in_use = 0;
+	obj = (uint8_t *)s + SLAB_HEADER + (c->per_slab - 1) * STRIDE(c);
+	for (i = 0; i < c->per_slab; i++, obj -= STRIDE(c)) {
+		if (c->ctor)
+			c->ctor(obj);
+		LINK(c, obj) = s->free;
+		s->free = obj;
+	}
+	slab_list_add(&c->partial, s);
+	c->slabs++;
+	return s;
+}
+
+/* Take up to n objects from the slabs.  Must be called with c->lock held. */
+static int slab_take(struct slab_cache *c, void **objs, int n)
+{
+	struct slab *s;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!(s = c->partial) && !(s = slab_grow(c)))
+			break;
+		objs[i] = s->free;
+		s->free = LINK(c, objs[i]);
+		s->in_use++;
+		if (!s->free) {
+			slab_list_del(&c->partial, s);
+			slab_list_add(&c->full, s);
+		}
+	}
+	return i;
+}
+
+/* Must be called with c->lock held. */
+static void slab_put(struct slab_cache *c, void *obj)
+{
+	struct slab *s = SLAB_OF(obj), *t;
+
+	if (!s->free) {
+		slab_list_del(&c->full, s);
+		slab_list_add(&c->partial, s);
+	}
+	LINK(c, obj) = s->free;
+	s->free = obj;
+	if (--s->in_use > 0)
+		return;
+	/* Keep one empty slab, release the others. */
+	for (t = c->partial; t; t = t->next) {
+		if (t != s && t->in_use == 0) {
+			slab_list_del(&c->partial, s);
+			pm_free(s);
+			c->slabs--;
+			return;
+		}
+	}
+}
+
+void *slab_alloc(struct slab_cache *c)
+{
+	struct slab_cpu *sc;
+	void *obj = NULL;
+
+	push_off();
+	sc = &c->cpu[current_cpuid()];
+	if (sc->count == 0) {
+		spin_lock_acquire(&c->lock);
+		sc->count = slab_take(c, sc->objs, SLAB_CPU_SIZE / 2);
+		spin_lock_release(&c->lock);
+	}
+	if (sc->count > 0) {
+		obj = sc->objs[--sc->count];
+		__sync_fetch_and_add(&c->in_use, 1);
+	}
+	pop_off();
+	return obj;
+}
+
+void slab_free(struct slab_cache *c, void *obj)
+{
+	struct slab_cpu *sc;
+
+	push_off();
+	sc = &c->cpu[current_cpuid()];
+	if (sc->count == SLAB_CPU_SIZE) {
+		spin_lock_acquire(&c->lock);
+		while (sc->count > SLAB_CPU_SIZE / 2)
+			slab_put(c, sc->objs[--sc->count]);
+		spin_lock_release(&c->lock);
+	}
+	sc->objs[sc->count++] = obj;
+	__sync_fetch_and_sub(&c->in_use, 1);
+	pop_off();
+}
+
+/*
+ * Give the free objects of this hart back to their slabs and release
+ * every slab without objects in use.  Return the number of pages
+ * released.
+ */
+size_t slab_shrink(struct slab_cache *c)
+{
+	struct slab_cpu *sc;
+	struct slab *s, *next;
+	size_t n = 0;
+
+	push_off();
+	sc = &c->cpu[current_cpuid()];
+	spin_lock_acquire(&c->lock);
+	while (sc->count > 0)
+		slab_put(c, sc->objs[--sc->count]);
+	for (s = c->partial; s; s = next) {
+		next = s->next;
+		if (s->in_use == 0) {
+			slab_list_del(&c->partial, s);
+			pm_free(s);
+			c->slabs--;
+			n++;
+		}
+	}
+	spin_lock_release(&c->lock);
+	pop_off();
+	return n;
+}
+
+/* Shrink every cache until nr pages are released. */
+static size_t slab_reclaim(size_t nr)
+{
+	struct slab_cache *c;
+	size_t n = 0;
+
+	spin_lock_acquire(&caches_lock);
+	for (c = caches; c && n < nr; c = c->next)
+		n += slab_shrink(c);
+	spin_lock_release(&caches_lock);
+	return n;
+}
+
+void slab_dump(void)
+{
+	struct slab_cache *c;
+
+	spin_lock_acquire(&caches_lock);
+	for (c = caches; c; c = c->next) {
+		printk("slab %s: %lu objects of %lu bytes in use, %lu slabs "
+		       "of %u\n",
+		       c->name, c->in_use, c->size, c->slabs, c->per_slab);
+	}
+	spin_lock_release(&caches_lock);
+}
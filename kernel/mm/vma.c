@@ -0,0 +1,427 @@
+#include "mm/vma.h"
+#include "fs/file.h"
+#include "fs/inode.h"
+#include "fs/log.h"
+#include "lib/string.h"
+#include "memlayout.h"
+#include "mm/mman.h"
+#include "mm/page_cache.h"
+#include "param.h"
+#include "printk.h"
+#include "riscv.h"
+#include "sched/proc.h"
+
+/*
+ * Each process has N_VMA slots in p->vmas.  Except for mmap() and
+ * munmap(), these functions take the whole array.
+ */
+
+/* Find an unused slot. */
+struct vma *vma_alloc(struct vma *vmas)
+{
+	struct vma *v;
+	for (v = vmas; v < vmas + N_VMA; v++) {
+		if (v->end == 0)
+			return v;
+	}
+	return NULL;
+}
+
+/* Find the range containing va. */
+struct vma *vma_find(struct vma *vmas, uint64_t va)
+{
+	struct vma *v;
+	for (v = vmas; v < vmas + N_VMA; v++) {
+		if (v->end != 0 && v->start <= va && va < v->end)
+			return v;
+	}
+	return NULL;
+}
+
+/* Does any range intersect [start, end)? */
+bool vma_overlap(struct vma *vmas, uint64_t start, uint64_t end)
+{
+	struct vma *v;
+	for (v = vmas; v < vmas + N_VMA; v++) {
+		if (v->end != 0 && v->start < end && start < v->end)
+			return true;
+	}
+	return false;
+}
+
+/* Copy all ranges for a child process. */
+void vma_dup(struct vma *dst, struct vma *src)
+{
+	uint32_t i;
+	for (i = 0; i < N_VMA; i++) {
+		dst[i] = src[i];
+		if (dst[i].inode)
+			idup(dst[i].inode);
+	}
+}
+
+/* Bytes of the page at offset off of v that come from the file. */
+static size_t vma_extent(struct vma *v, uint64_t off)
+{
+	uint64_t n, foff;
+
+	if (!v->inode || off >= v->file_size)
+		return 0;
+	n = v->file_size - off;
+	if (n > PAGE_SIZE)
+		n = PAGE_SIZE;
+	foff = v->off + off;
+	if (foff >= v->inode->size)
+		return 0;
+	if (n > v->inode->size - foff)
+		n = v->inode->size - foff;
+	return n;
+}
+
+/*
+ * Return a page with the contents of v at off, or NULL.  Must be called
+ * with the inode of v, if any, locked, so that no write to the file
+ * comes between reading a page and caching it.
+ */
+static void *vma_page(struct vma *v, uint64_t off)
+{
+	void *mem, *page;
+	size_t n;
+	bool cached;
+
+	n = vma_extent(v, off);
+	/* There is no file behind a shared page past its end. */
+	if ((v->flags & VMA_SHARED) && v->inode && n == 0)
+		return NULL;
+
+	/*
+	 * Read-only and shared file pages are shared through the page
+	 * cache, private writable ones are copies.
+	 */
+	cached = n > 0 && (!(v->perm & PTE_W) || (v->flags & VMA_SHARED));
+	if (cached && (mem = page_cache_lookup(v->inode, v->off + off, n)))
+		return mem;
+	if (!(mem = pm_zalloc()))
+		return NULL;
+	if (n > 0 &&
+	    readi(v->inode, false, (uint64_t)mem, v->off + off, n) != n) {
+		pm_free(mem);
+		return NULL;
+	}
+	if (!cached)
+		return mem;
+
+	/*
+	 * A shared page must be the cached one, which writei() keeps up to
+	 * date, or the mapping and the file would part ways.  Read-only
+	 * pages do without the cache if there is no memory for an entry.
+	 */
+	if ((page = page_cache_insert(v->inode, v->off + off, n, mem)))
+		return page;
+	if (v->flags & VMA_SHARED) {
+		pm_free(mem);
+		return NULL;
+	}
+	return mem;
+}
+
+/*
+ * Write a shared page back to its file.  Like file_write(), only a few
+ * blocks go into each transaction so that the log cannot overflow.
+ */
+static void vma_sync_page(struct vma *v, uint64_t va, void *page)
+{
+	size_t n, i, len, max;
+	uint32_t off;
+
+	off = v->off + (va - v->start);
+	n = vma_extent(v, va - v->start);
+	max = ((MAX_OP_BLKS - 1 - 1 - 2) / 2) * BLOCK_SIZE;
+	for (i = 0; i < n; i += len) {
+		len = n - i;
+		if (len > max)
+			len = max;
+		begin_op();
+		ilock(v->inode);
+		writei(v->inode, false, (uint64_t)page + i, off + i, len);
+		iunlock(v->inode);
+		end_op();
+	}
+}
+
+/* Write back the written shared pages in [start, end) and unmap it. */
+static void vma_unmap(pte_t *page_table, struct vma *v, uint64_t start,
+		      uint64_t end)
+{
+	uint64_t va;
+	pte_t *pte;
+
+	if ((v->flags & VMA_SHARED) && v->inode) {
+		for (va = start; va < end; va += PAGE_SIZE) {
+			pte = walk(page_table, va, false);
+			if (pte && (*pte & PTE_V) && (*pte & PTE_DIRTY))
+				vma_sync_page(v, va, (void *)PTE2PA(*pte));
+		}
+	}
+	uvm_unmap(page_table, start, end - start);
+}
+
+/* Drop the first part of v up to start. */
+static void vma_advance(struct vma *v, uint64_t start)
+{
+	uint64_t d = start - v->start;
+	v->off += d;
+	v->file_size = v->file_size > d ? v->file_size - d : 0;
+	v->start = start;
+}
+
+/*
+ * Copy the pages of the ranges for a child process.  Ranges inside
+ * [0, size) are copied along with the heap by copy_user_page_table().
+ */
+int vma_copy(pte_t *dst, pte_t *src, struct vma *vmas, uint64_t size)
+{
+	struct vma *v, *w;
+	uint64_t va;
+	pte_t *pte;
+
+	for (v = vmas; v < vmas + N_VMA; v++) {
+		if (v->end == 0 || v->start < size)
+			continue;
+		if (v->flags & VMA_SHARED) {
+			/*
+			 * Shared anonymous memory has nowhere else to be
+			 * found, so populate it before the processes part.
+			 */
+			for (va = v->start; !v->inode && va < v->end;
+			     va += PAGE_SIZE) {
+				pte = walk(src, va, false);
+				if ((!pte || !(*pte & PTE_V)) &&
+				    vma_fault(src, v, va, false))
+					goto bad;
+			}
+		}
+		if (uvm_copy(dst, src, v->start, v->end,
+			     !(v->flags & VMA_SHARED)))
+			goto bad;
+	}
+	return 0;
+
+bad:
+	for (w = vmas; w < v; w++) {
+		if (w->end != 0 && w->start >= size)
+			uvm_unmap(dst, w->start, w->end - w->start);
+	}
+	return -1;
+}
+
+/*
+ * Unmap all ranges, writing shared pages back, and drop the references
+ * to their files.  Must not be called inside a transaction.
+ */
+void vma_clear(pte_t *page_table, struct vma *vmas)
+{
+	struct vma *v;
+	bool has_inode = false;
+
+	for (v = vmas; v < vmas + N_VMA; v++) {
+		if (v->end != 0)
+			vma_unmap(page_table, v, v->start, v->end);
+		if (v->inode)
+			has_inode = true;
+	}
+	if (has_inode) {
+		begin_op();
+		for (v = vmas; v < vmas + N_VMA; v++) {
+			if (v->inode)
+				iput(v->inode);
+		}
+		end_op();
+	}
+	memset(vmas, 0, N_VMA * sizeof(*vmas));
+}
+
+/*
+ * Populate the page at va of v, or make a shared page that was mapped
+ * by a load writable.
+ */
+int vma_fault(pte_t *page_table, struct vma *v, uint64_t va, bool write)
+{
+	void *mem;
+	uint64_t perm;
+	pte_t *pte;
+
+	if (!(v->perm & PTE_R) || (write && !(v->perm & PTE_W)))
+		return -1;
+	va = PAGE_ROUND_DOWN(va);
+
+	/*
+	 * Shared file pages are mapped read-only by loads, so the first
+	 * store marks them to be written back by vma_unmap().
+	 */
+	pte = walk(page_table, va, false);
+	if (pte && (*pte & PTE_V)) {
+		if (write && (v->flags & VMA_SHARED) && !(*pte & PTE_W)) {
+			*pte |= PTE_W | PTE_DIRTY;
+			return 0;
+		}
+		return -1;
+	}
+	perm = v->perm | PTE_U;
+	if ((v->flags & VMA_SHARED) && v->inode) {
+		if (write)
+			perm |= PTE_DIRTY;
+		else
+			perm &= ~PTE_W;
+	}
+
+	/*
+	 * System calls prefault user buffers before taking locks, so no
+	 * inode is held here.
+	 */
+	if (v->inode)
+		ilock(v->inode);
+	mem = vma_page(v, va - v->start);
+	if (v->inode)
+		iunlock(v->inode);
+	if (!mem)
+		return -1;
+
+	if (map_pages(page_table, va, (uint64_t)mem, PAGE_SIZE, perm)) {
+		pm_free(mem);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Populate v as far as memory allows, leaving the rest to vma_fault().
+ * Private anonymous memory is allocated a page table at a time by
+ * uvm_alloc(), the rest page by page.
+ */
+static void vma_populate(pte_t *page_table, struct vma *v)
+{
+	uint64_t va;
+
+	if (!(v->perm & PTE_R))
+		return;
+	if (!v->inode && !(v->flags & VMA_SHARED)) {
+		uvm_alloc(page_table, v->start, v->end,
+			  v->perm & (PTE_W | PTE_X));
+		return;
+	}
+	for (va = v->start; va < v->end; va += PAGE_SIZE) {
+		if (vma_fault(page_table, v, va, false))
+			break;
+	}
+}
+
+/*
+ * Map len bytes of f at off, or anonymous memory if f is NULL, below
+ * the lowest mapping that leaves room for it.  Pages are populated
+ * by vma_fault(), or right away with MAP_POPULATE.  Return the
+ * address, or -1.
+ */
+uint64_t mmap(struct process *p, uint64_t len, int prot, int flags,
+	      struct file *f, uint32_t off)
+{
+	struct vma *v, *w;
+	uint64_t start, end;
+	uint32_t perm;
+
+	if (len == 0 || len > USER_MMAP_TOP || off % PAGE_SIZE != 0)
+		return -1;
+	if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+		return -1;
+	len = PAGE_ROUND_UP(len);
+
+	perm = 0;
+	if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+		perm |= PTE_R;
+	if (prot & PROT_WRITE)
+		perm |= PTE_W;
+	if (prot & PROT_EXEC)
+		perm |= PTE_X;
+
+	if (f) {
+		if (f->type != FD_INODE || !f->readable)
+			return -1;
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+		    !f->writable)
+			return -1;
+	}
+
+	if (!(v = vma_alloc(p->vmas)))
+		return -1;
+
+	/* Search downwards for a hole. */
+	end = USER_MMAP_TOP;
+	while (true) {
+		start = end - len;
+		if (end < len || start < PAGE_ROUND_UP(p->size))
+			return -1;
+		for (w = p->vmas; w < p->vmas + N_VMA; w++) {
+			if (w->end != 0 && w->start < end && start < w->end)
+				break;
+		}
+		if (w == p->vmas + N_VMA)
+			break;
+		end = w->start;
+	}
+
+	v->start = start;
+	v->end = end;
+	v->inode = f ? idup(f->inode) : NULL;
+	v->off = off;
+	v->file_size = f ? len : 0;
+	v->perm = perm;
+	v->flags = (flags & MAP_SHARED) ? VMA_SHARED : 0;
+	if (flags & MAP_POPULATE)
+		vma_populate(p->page_table, v);
+	return start;
+}
+
+/* Unmap [addr, addr + len), splitting the ranges it cuts. */
+int munmap(struct process *p, uint64_t addr, uint64_t len)
+{
+	struct vma *v, *tail;
+	uint64_t start, end;
+
+	if (addr % PAGE_SIZE != 0 || len == 0)
+		return -1;
+	len = PAGE_ROUND_UP(len);
+	if (addr + len < addr || addr + len > MAX_VADDR)
+		return -1;
+
+	for (v = p->vmas; v < p->vmas + N_VMA; v++) {
+		if (v->end == 0 || v->end <= addr || addr + len <= v->start)
+			continue;
+		start = addr > v->start ? addr : v->start;
+		end = addr + len < v->end ? addr + len : v->end;
+		tail = NULL;
+		if (v->start < start && end < v->end) {
+			/* The hole splits v in two. */
+			if (!(tail = vma_alloc(p->vmas)))
+				return -1;
+			*tail = *v;
+			if (tail->inode)
+				idup(tail->inode);
+			vma_advance(tail, end);
+		}
+		vma_unmap(p->page_table, v, start, end);
+		if (tail || end == v->end) {
+			v->end = start;
+		} else {
+			vma_advance(v, end);
+		}
+		if (v->start == v->end) {
+			if (v->inode) {
+				begin_op();
+				iput(v->inode);
+				end_op();
+			}
+			memset(v, 0, sizeof(*v));
+		}
+	}
+	return 0;
+}
@@ -10,6 +10,13 @@ struct cpu *current_cpu(void)
 	return &cpus[id];
 }
 
+struct cpu *cpu_get(int id)
+{
+	if (id < 0 || id >= N_CPU)
+		panic("invalid cpu id");
+	return &cpus[id];
+}
+
 int current_cpuid(void)
 {
 	int id = read_tp();
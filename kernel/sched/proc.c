@@ -1,17 +1,41 @@
 #include "sched/proc.h"
+#include "dev/timer.h"
 #include "fs/file.h"
 #include "fs/fs.h"
 #include "fs/inode.h"
 #include "fs/log.h"
 #include "lib/string.h"
 #include "memlayout.h"
+#include "mm/asid.h"
+#include "mm/memstat.h"
+#include "mm/shrinker.h"
+#include "mm/slab.h"
 #include "printk.h"
 #include "riscv.h"
+#include "sbi.h"
 #include "sched/cpu.h"
 #include "sched/proc.h"
+#include "sched/rusage.h"
 #include "trap/trap.h"
 
-static struct process procs[N_PROC];
+/*
+ * Processes come from a slab cache as they are needed, each with a
+ * kernel stack slot of its own.  A process stays on the list once
+ * made and is reused when unused, since other harts keep unlocked
+ * pointers to processes.  The kstack shrinker frees the stacks of
+ * unused processes, which get new pages when reused.
+ */
+static struct slab_cache proc_cache;
+static struct process *procs; /* All processes, newest first */
+static int n_procs;	      /* Kernel stack slots taken */
+static struct spin_lock procs_lock; /* Serializes adding to procs */
+
+static size_t kstack_shrink(size_t nr);
+
+static struct shrinker kstack_shrinker = {
+	.name = "kstack",
+	.shrink = kstack_shrink,
+};
 
 static struct process *init_proc;
 
@@ -22,8 +46,351 @@ static struct spin_lock wait_lock;
 
 extern void context_switch(struct context *from, struct context *to);
 
-#define FIRST_PROC (&procs[0])
-#define LAST_PROC (&procs[N_PROC - 1])
+#define TO_USEC(t) ((t) / (TIMER_FREQ / 1000000))
+
+/*
+ * Kernel stacks are painted, so the lowest word overwritten marks how
+ * deep a process has used its stack.
+ */
+#define KSTACK_PAINT 0x5a
+#define KSTACK_PAINT_WORD 0x5a5a5a5a5a5a5a5aul
+
+static uint64_t kstack_peak; /* Most bytes used by any process */
+
+/* Bytes of its kernel stack p has used at most. */
+static uint64_t kstack_used(struct process *p)
+{
+	uint64_t *w = (uint64_t *)p->kernel_stack;
+	uint64_t *top = (uint64_t *)(p->kernel_stack + KERNEL_STACK_SIZE);
+
+	while (w < top && *w == KSTACK_PAINT_WORD)
+		w++;
+	return (uint64_t)top - (uint64_t)w;
+}
+
+/*
+ * Scheduling classes.  A process belongs to the class of its policy,
+ * and every class keeps its own part of each run queue.  Processes of
+ * an earlier class in sched_classes[] always run first.
+ */
+struct sched_class {
+	const char *name;
+	int rank; /* Index in sched_classes[] */
+	void (*enqueue)(struct run_queue *rq, struct process *p);
+	bool (*dequeue)(struct run_queue *rq, struct process *p);
+	/* Take the process to run next off rq, if any. */
+	struct process *(*pick)(struct run_queue *rq);
+	/* p ran for delta units of read_time(). */
+	void (*charge)(struct process *p, uint64_t delta);
+	/* Should a run before b of the same class? */
+	bool (*before)(struct process *a, struct process *b);
+};
+
+static void list_append(struct rq_list *l, struct process *p)
+{
+	p->rq_next = NULL;
+	if (l->tail)
+		l->tail->rq_next = p;
+	else
+		l->head = p;
+	l->tail = p;
+}
+
+static struct process *list_take(struct rq_list *l)
+{
+	struct process *p;
+
+	if ((p = l->head)) {
+		l->head = p->rq_next;
+		if (!l->head)
+			l->tail = NULL;
+		p->rq_next = NULL;
+	}
+	return p;
+}
+
+static bool list_del(struct rq_list *l, struct process *p)
+{
+	struct process **pp, *prev = NULL;
+
+	for (pp = &l->head; *pp; prev = *pp, pp = &(*pp)->rq_next) {
+		if (*pp == p) {
+			*pp = p->rq_next;
+			if (l->tail == p)
+				l->tail = prev;
+			p->rq_next = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * The fixed-priority class: the highest priority runs first, round
+ * robin among equals.
+ */
+static void fixed_enqueue(struct run_queue *rq, struct process *p)
+{
+	list_append(&rq->fixed[p->prio], p);
+}
+
+static bool fixed_dequeue(struct run_queue *rq, struct process *p)
+{
+	return list_del(&rq->fixed[p->prio], p);
+}
+
+static struct process *fixed_pick(struct run_queue *rq)
+{
+	struct process *p;
+	int prio;
+
+	for (prio = PRIO_FIXED_MAX; prio >= 0; prio--) {
+		if ((p = list_take(&rq->fixed[prio])))
+			return p;
+	}
+	return NULL;
+}
+
+static void fixed_charge(struct process *p, uint64_t delta)
+{
+}
+
+static bool fixed_before(struct process *a, struct process *b)
+{
+	return a->prio > b->prio;
+}
+
+/*
+ * The fair class: the process that has had the least virtual runtime
+ * runs first.  Virtual runtime passes slower for a lower nice value,
+ * so processes share the cpu in proportion to their weights.  The
+ * queue is a list sorted by virtual runtime, which is short enough
+ * for the processes of one cpu.
+ */
+#define FAIR_LATENCY 1000000 /* Sleeper credit, a tick of read_time() */
+#define NICE_0_WEIGHT 1024
+
+/* Weights of nice -20 to 19, each step about 1.25 times the next. */
+static const uint32_t nice_weights[] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705,
+	14949, 11916, 9548, 7620, 6100, 4904, 3906, 3121,
+	2501, 1991, 1586, 1277, 1024, 820, 655, 526,
+	423, 335, 272, 215, 172, 137, 110, 87,
+	70, 56, 45, 36, 29, 23, 18, 15,
+};
+
+static void fair_enqueue(struct run_queue *rq, struct process *p)
+{
+	struct process **pp;
+
+	/*
+	 * A process that slept gets at most FAIR_LATENCY of credit, or it
+	 * would hold the cpu until it caught up with the others.
+	 */
+	if (p->vruntime < rq->min_vruntime - FAIR_LATENCY)
+		p->vruntime = rq->min_vruntime - FAIR_LATENCY;
+	for (pp = &rq->fair.head; *pp; pp = &(*pp)->rq_next) {
+		if (p->vruntime < (*pp)->vruntime)
+			break;
+	}
+	p->rq_next = *pp;
+	*pp = p;
+	if (!p->rq_next)
+		rq->fair.tail = p;
+}
+
+static bool fair_dequeue(struct run_queue *rq, struct process *p)
+{
+	return list_del(&rq->fair, p);
+}
+
+static struct process *fair_pick(struct run_queue *rq)
+{
+	struct process *p;
+
+	if ((p = list_take(&rq->fair)) && p->vruntime > rq->min_vruntime)
+		rq->min_vruntime = p->vruntime;
+	return p;
+}
+
+static void fair_charge(struct process *p, uint64_t delta)
+{
+	p->vruntime += delta * NICE_0_WEIGHT / nice_weights[p->nice - NICE_MIN];
+}
+
+static bool fair_before(struct process *a, struct process *b)
+{
+	return a->vruntime < b->vruntime;
+}
+
+static const struct sched_class fixed_class = {
+	.name = "fixed",
+	.rank = 0,
+	.enqueue = fixed_enqueue,
+	.dequeue = fixed_dequeue,
+	.pick = fixed_pick,
+	.charge = fixed_charge,
+	.before = fixed_before,
+};
+
+static const struct sched_class fair_class = {
+	.name = "fair",
+	.rank = 1,
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.pick = fair_pick,
+	.charge = fair_charge,
+	.before = fair_before,
+};
+
+static const struct sched_class *sched_classes[] = { &fixed_class,
+						     &fair_class };
+
+#define N_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+static const struct sched_class *sched_class(struct process *p)
+{
+	return p->policy == SCHED_FIXED ? &fixed_class : &fair_class;
+}
+
+/* Should a preempt b? */
+static bool outranks(struct process *a, struct process *b)
+{
+	const struct sched_class *ca = sched_class(a), *cb = sched_class(b);
+
+	if (ca != cb)
+		return ca->rank < cb->rank;
+	return ca->before(a, b);
+}
+
+/*
+ * Wake up the cpu that should see a newly queued process on cpu id:
+ * that cpu if it idles or should switch to it, else an idle cpu that
+ * can steal it.  Idle harts wait in wfi without a tick.
+ */
+static void cpu_kick(int id, bool resched)
+{
+	int i, self = current_cpuid();
+
+	/* This cpu is in scheduler() and will take it itself. */
+	if (id == self && !cpu_get(self)->proc)
+		return;
+	__sync_synchronize();
+	if (cpu_get(id)->idle || resched) {
+		if (id != self)
+			sbi_send_ipi(1ul << id);
+		return;
+	}
+	for (i = 0; i < N_CPU; i++) {
+		if (i != self && cpu_get(i)->idle) {
+			sbi_send_ipi(1ul << i);
+			return;
+		}
+	}
+}
+
+/*
+ * Make p runnable and queue it on the cpu it last ran on, whose caches
+ * and TLB may still hold its data.  If p outranks the process running
+ * there, that cpu switches at its next trap.  p->lock must be held.
+ */
+static void rq_add(struct process *p)
+{
+	struct cpu *c = cpu_get(p->cpu);
+	struct run_queue *rq = &c->rq;
+	struct process *running;
+	bool resched = false;
+
+	if (!spin_lock_holding(&p->lock))
+		panic("queue a process without its lock");
+	p->state = PROC_RUNNABLE;
+	p->queued_at = read_time();
+	spin_lock_acquire(&rq->lock);
+	sched_class(p)->enqueue(rq, p);
+	rq->nr++;
+	/* Unlocked, running is only a hint. */
+	running = c->proc;
+	if (running && outranks(p, running))
+		resched = c->resched = true;
+	spin_lock_release(&rq->lock);
+	cpu_kick(p->cpu, resched);
+}
+
+/* Is any process queued on any cpu? */
+static bool rq_any(void)
+{
+	int i;
+
+	for (i = 0; i < N_CPU; i++) {
+		if (cpu_get(i)->rq.nr > 0)
+			return true;
+	}
+	return false;
+}
+
+static struct process *rq_take(struct run_queue *rq)
+{
+	struct process *p = NULL;
+	uint32_t i;
+
+	/* Peek without the lock, a racing rq_add() is seen next pass. */
+	if (rq->nr == 0)
+		return NULL;
+	spin_lock_acquire(&rq->lock);
+	for (i = 0; i < N_CLASSES && !p; i++)
+		p = sched_classes[i]->pick(rq);
+	if (p)
+		rq->nr--;
+	spin_lock_release(&rq->lock);
+	return p;
+}
+
+/* Should the running process give up the cpu to a queued one? */
+bool need_resched(void)
+{
+	bool resched;
+
+	push_off();
+	resched = current_cpu()->resched;
+	pop_off();
+	return resched;
+}
+
+/*
+ * Take the next process to run from this cpu's queue.  An idle cpu
+ * steals from the busiest queue instead.
+ */
+static struct process *rq_next(struct cpu *c)
+{
+	struct cpu *busiest, *o;
+	struct process *p;
+	int i;
+
+	if ((p = rq_take(&c->rq)))
+		return p;
+	busiest = NULL;
+	for (i = 0; i < N_CPU; i++) {
+		o = cpu_get(i);
+		if (o != c && o->rq.nr > 0 &&
+		    (!busiest || o->rq.nr > busiest->rq.nr))
+			busiest = o;
+	}
+	if (busiest && (p = rq_take(&busiest->rq)))
+		c->steals++;
+	return p;
+}
+
+/* Note the depth p reached and repaint what it used for the next. */
+static void kstack_reset(struct process *p)
+{
+	uint64_t used = kstack_used(p), peak;
+
+	while ((peak = kstack_peak) < used &&
+	       !__sync_bool_compare_and_swap(&kstack_peak, peak, used))
+		;
+	memset((void *)(p->kernel_stack + KERNEL_STACK_SIZE - used),
+	       KSTACK_PAINT, used);
+}
 
 static pid_t pid_alloc(void)
 {
@@ -63,12 +430,11 @@ void proc_init(void)
 	uint32_t i;
 	spin_lock_init(&pid_lock, "pid_lock");
 	spin_lock_init(&wait_lock, "wait_lock");
-	for (i = 0; i < N_PROC; i++) {
-		spin_lock_init(&procs[i].lock, "process");
-		procs[i].pid = -1;
-		procs[i].state = PROC_UNUSED;
-		procs[i].kernel_stack = KERNEL_STACK(i);
-	}
+	for (i = 0; i < N_CPU; i++)
+		spin_lock_init(&cpu_get(i)->rq.lock, "run_queue");
+	spin_lock_init(&procs_lock, "procs");
+	slab_cache_init(&proc_cache, "process", sizeof(struct process), NULL);
+	shrinker_register(&kstack_shrinker);
 }
 
 static void fork_return(void)
@@ -82,38 +448,130 @@ static void fork_return(void)
 	user_trap_return();
 }
 
+/*
+ * Make a process in the next kernel stack slot and add it to the list,
+ * locked and PROC_USED.  Return NULL if out of memory or slots.
+ */
+static struct process *proc_new(void)
+{
+	struct process *p;
+
+	if (!(p = slab_alloc(&proc_cache)))
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	spin_lock_init(&p->lock, "process");
+	wait_queue_init(&p->child_exit);
+	p->pid = -1;
+	p->state = PROC_USED;
+
+	spin_lock_acquire(&procs_lock);
+	if (n_procs == N_PROC || kvm_map_stack(KERNEL_STACK(n_procs))) {
+		spin_lock_release(&procs_lock);
+		slab_free(&proc_cache, p);
+		return NULL;
+	}
+	p->kernel_stack = KERNEL_STACK(n_procs++);
+	p->kstack_mapped = true;
+	memset((void *)p->kernel_stack, KSTACK_PAINT, KERNEL_STACK_SIZE);
+	spin_lock_acquire(&p->lock);
+	p->all_next = procs;
+	/* Lists are walked unlocked, so publish p once it is set up. */
+	__sync_synchronize();
+	procs = p;
+	spin_lock_release(&procs_lock);
+	return p;
+}
+
+/*
+ * Give unused p, locked, new pages for the kernel stack the shrinker
+ * took.  procs_lock keeps kvm_map_stack() to one hart at a time.
+ */
+static int kstack_map(struct process *p)
+{
+	int ret;
+
+	spin_lock_acquire(&procs_lock);
+	if ((ret = kvm_map_stack(p->kernel_stack)))
+		kvm_unmap_stack(p->kernel_stack);
+	spin_lock_release(&procs_lock);
+	if (ret)
+		return -1;
+	p->kstack_mapped = true;
+	memset((void *)p->kernel_stack, KSTACK_PAINT, KERNEL_STACK_SIZE);
+	return 0;
+}
+
+/*
+ * Free the kernel stacks of unused processes, up to nr pages.  The lock
+ * of a process may be held around the pm_alloc() that got here, so
+ * processes whose lock is taken are skipped.
+ */
+static size_t kstack_shrink(size_t nr)
+{
+	struct process *p;
+	size_t n = 0;
+
+	for (p = procs; p && n < nr; p = p->all_next) {
+		if (!spin_lock_try(&p->lock))
+			continue;
+		if (p->state == PROC_UNUSED && p->kstack_mapped) {
+			n += kvm_unmap_stack(p->kernel_stack);
+			p->kstack_mapped = false;
+		}
+		spin_lock_release(&p->lock);
+	}
+	return n;
+}
+
 struct process *proc_alloc(void)
 {
 	struct process *p;
-	for (p = FIRST_PROC; p <= LAST_PROC; p++) {
+
+	for (p = procs; p; p = p->all_next) {
 		spin_lock_acquire(&p->lock);
-		if (p->state == PROC_UNUSED) {
-			p->pid = pid_alloc();
-			p->state = PROC_USED;
-			p->tf = pm_alloc();
-			if (!p->tf) {
-				proc_free(p);
-				spin_lock_release(&p->lock);
-				return NULL;
-			}
-			p->page_table = get_user_page_table(p);
-			if (!p->page_table) {
-				proc_free(p);
-				spin_lock_release(&p->lock);
-				return NULL;
-			}
-			memset(&p->ctx, 0, sizeof(p->ctx));
-			p->ctx.ra = (uint64_t)fork_return;
-			p->ctx.sp = p->kernel_stack + PAGE_SIZE;
-			return p;
-		}
+		if (p->state == PROC_UNUSED)
+			break;
 		spin_lock_release(&p->lock);
 	}
-	return NULL;
+	if (!p && !(p = proc_new()))
+		return NULL;
+	if (!p->kstack_mapped && kstack_map(p)) {
+		spin_lock_release(&p->lock);
+		return NULL;
+	}
+
+	p->pid = pid_alloc();
+	p->state = PROC_USED;
+	p->cpu = current_cpuid(); /* next to its parent */
+	p->policy = SCHED_FAIR;
+	p->nice = 0;
+	p->prio = 0;
+	p->vruntime = 0;
+	p->utime = p->stime = p->wtime = 0;
+	p->nvcsw = p->nivcsw = 0;
+	p->cutime = p->cstime = p->cwtime = 0;
+	p->tf = pm_alloc();
+	if (!p->tf) {
+		proc_free(p);
+		spin_lock_release(&p->lock);
+		return NULL;
+	}
+	p->page_table = get_user_page_table(p);
+	if (!p->page_table) {
+		proc_free(p);
+		spin_lock_release(&p->lock);
+		return NULL;
+	}
+	p->rss = 0;
+	memset(&p->ctx, 0, sizeof(p->ctx));
+	p->ctx.ra = (uint64_t)fork_return;
+	p->ctx.sp = p->kernel_stack + KERNEL_STACK_SIZE;
+	return p;
 }
 
 void proc_free(struct process *p)
 {
+	kstack_reset(p);
 	if (p->tf)
 		pm_free(p->tf);
 	p->tf = NULL;
@@ -121,37 +579,46 @@ void proc_free(struct process *p)
 		free_user_page_table(p->page_table, p->size);
 	p->page_table = NULL;
 	p->size = 0;
+	p->rss = 0;
+	asid_release(p);
+	p->tlb_stale = 0;
 	pid_free(p->pid);
 	p->pid = -1;
 	p->parent = NULL;
-	p->chan = NULL;
 	p->killed = false;
 	p->xstate = 0;
 	p->state = PROC_UNUSED;
 }
 
+/*
+ * Change the size of the process memory.  Growing only moves p->size;
+ * the new pages are populated by uvm_fault() when they are touched.
+ */
 int proc_grow(uint64_t size)
 {
 	struct process *p = running_proc();
-	uint64_t new_size = 0;
-	if (size > p->size)
-		new_size = uvm_alloc(p->page_table, p->size, size, PTE_W);
-	else
-		new_size = uvm_dealloc(p->page_table, p->size, size);
-	if (new_size != 0) {
-		p->size = new_size;
-		return 0;
-	} else {
+
+	/* keep clear of the mmap() regions and the stack */
+	if (size > USER_MMAP_TOP)
 		return -1;
-	}
+	/* nor grow into a mapping */
+	if (size > p->size && vma_overlap(p->vmas, PAGE_ROUND_UP(p->size),
+					  PAGE_ROUND_UP(size)))
+		return -1;
+	if (size < p->size)
+		uvm_dealloc(p->page_table, p->size, size);
+	p->size = size;
+	return 0;
 }
 
 void proc_dump(void)
 {
 	struct process *p;
+	struct cpu *c;
 	char *state;
+	int i;
 	printk("\n");
-	for (p = FIRST_PROC; p <= LAST_PROC; p++) {
+	for (p = procs; p; p = p->all_next) {
 		if (p->state == PROC_UNUSED)
 			continue;
 		switch (p->state) {
@@ -174,15 +641,28 @@ void proc_dump(void)
 			state = "???     ";
 			break;
 		}
-		printk("%s %d %s\n", state, p->pid, p->name);
+		printk("%s %d %s %s %lu pages, kernel stack %lu bytes\n",
+		       state, p->pid, p->name, sched_class(p)->name, p->rss,
+		       kstack_used(p));
+		printk("    user %lu us, sys %lu us, wait %lu us, "
+		       "%lu voluntary, %lu involuntary switches\n",
+		       TO_USEC(p->utime), TO_USEC(p->stime), TO_USEC(p->wtime),
+		       p->nvcsw, p->nivcsw);
+	}
+	printk("kernel stack peak %lu of %lu bytes\n", kstack_peak,
+	       KERNEL_STACK_SIZE);
+	for (i = 0; i < N_CPU; i++) {
+		c = cpu_get(i);
+		printk("cpu %d: %d queued, %lu steals, %lu migrations\n", i,
+		       c->rq.nr, c->steals, c->migrations);
 	}
 }
 
 void scheduler(void)
 {
 	struct process *p;
-	bool found;
 	struct cpu *c;
+	uint64_t now;
 
 	c = current_cpu();
 	c->proc = NULL;
@@ -193,35 +673,58 @@ void scheduler(void)
 		 * waiting.
 		 */
 		intr_on();
-		found = false;
-		for (p = FIRST_PROC; p <= LAST_PROC; p++) {
+		if ((p = rq_next(c))) {
 			spin_lock_acquire(&p->lock);
-			if (p->state == PROC_RUNNABLE) {
-				found = true;
-				/*
-				 * Switch to chosen process.  It is the
-				 * process's job to release its lock and then
-				 * reacquire it before jumping back to us.
-				 */
-				p->state = PROC_RUNNING;
-				c->proc = p;
-				context_switch(&c->ctx, &p->ctx);
-				/*
-				 * Process is done running for now.
-				 * It should have changed its p->state before
-				 * coming back.
-				 */
-				c->proc = NULL;
+			if (p->state != PROC_RUNNABLE)
+				panic("queued process is not runnable");
+			/*
+			 * Switch to chosen process.  It is the process's job
+			 * to release its lock and then reacquire it before
+			 * jumping back to us.
+			 */
+			p->state = PROC_RUNNING;
+			if (p->cpu != current_cpuid()) {
+				/* Keep its place relative to the new queue. */
+				p->vruntime += c->rq.min_vruntime -
+					       cpu_get(p->cpu)->rq.min_vruntime;
+				p->cpu = current_cpuid();
+				c->migrations++;
 			}
+			c->proc = p;
+			c->resched = false;
+			timer_set_next();
+			now = read_time();
+			p->wtime += now - p->queued_at;
+			p->mark = p->run_start = now;
+			context_switch(&c->ctx, &p->ctx);
+			/*
+			 * Process is done running for now.
+			 * It should have changed its p->state before
+			 * coming back.
+			 */
+			c->proc = NULL;
+			sched_class(p)->charge(p, p->mark - p->run_start);
+			/* yield() leaves queueing to us, now p is switched out. */
+			if (p->state == PROC_RUNNABLE)
+				rq_add(p);
 			spin_lock_release(&p->lock);
-		}
-		if (!found) {
+		} else if (!pm_zero_idle()) {
 			/*
-			 * Nothing to run; stop running on this core until an
-			 * interrupt.
+			 * Nothing to run, nor any page to zero; stop running
+			 * on this core until an interrupt.  With interrupts
+			 * off, one that queues a process after the check
+			 * still ends wfi, and rq_add() sees c->idle before
+			 * the check, or the check sees its process.
 			 */
+			intr_off();
+			c->idle = true;
+			__sync_synchronize();
+			if (!rq_any()) {
+				timer_idle();
+				asm volatile("wfi");
+			}
+			c->idle = false;
 			intr_on();
-			asm volatile("wfi");
 		}
 	}
 }
@@ -230,6 +733,7 @@ void sched(void)
 {
 	struct process *p;
 	struct cpu *c;
+	uint64_t now;
 	bool intr_ena;
 
 	p = running_proc();
@@ -244,6 +748,15 @@ void sched(void)
 	if (intr_get())
 		panic("scheduling can be interrupted");
 
+	/* Close the kernel period; scheduler() charges up to p->mark. */
+	now = read_time();
+	p->stime += now - p->mark;
+	p->mark = now;
+	if (p->state == PROC_RUNNABLE)
+		p->nivcsw++;
+	else if (p->state == PROC_SLEEPING)
+		p->nvcsw++;
+
 	intr_ena = c->intr_ena;
 	context_switch(&p->ctx, &c->ctx);
 	c->intr_ena = intr_ena;
@@ -294,6 +807,15 @@ pid_t fork(void)
 		return -1;
 	}
 	child->size = parent->size;
+	if (vma_copy(child->page_table, parent->page_table, parent->vmas,
+		     parent->size)) {
+		proc_free(child);
+		spin_lock_release(&child->lock);
+		return -1;
+	}
+	vma_dup(child->vmas, parent->vmas);
+	/* The child maps every page the parent maps. */
+	child->rss = parent->rss;
 
 	/* copy trap frame */
 	memmove(child->tf, parent->tf, sizeof(*(parent->tf)));
@@ -310,6 +832,12 @@ pid_t fork(void)
 	/* copy process name */
 	strncpy(child->name, parent->name, sizeof(child->name));
 
+	/* the child starts where the parent is in its class */
+	child->policy = parent->policy;
+	child->nice = parent->nice;
+	child->prio = parent->prio;
+	child->vruntime = parent->vruntime;
+
 	/* the return value of process */
 	pid = child->pid;
 
@@ -324,7 +852,7 @@ pid_t fork(void)
 	spin_lock_release(&wait_lock);
 
 	spin_lock_acquire(&child->lock);
-	child->state = PROC_RUNNABLE;
+	rq_add(child);
 	spin_lock_release(&child->lock);
 
 	return pid;
@@ -333,12 +861,12 @@ pid_t fork(void)
 int kill(pid_t pid)
 {
 	struct process *p;
-	for (p = FIRST_PROC; p <= LAST_PROC; p++) {
+	for (p = procs; p; p = p->all_next) {
 		spin_lock_acquire(&p->lock);
 		if (p->pid == pid) {
 			p->killed = true;
 			if (p->state == PROC_SLEEPING)
-				p->state = PROC_RUNNABLE;
+				rq_add(p);
 			spin_lock_release(&p->lock);
 			return 0;
 		}
@@ -347,6 +875,120 @@ int kill(pid_t pid)
 	return -1;
 }
 
+/*
+ * Move the process pid, or the caller if pid is 0, to policy.  value
+ * is the nice value for SCHED_FAIR and the priority for SCHED_FIXED.
+ */
+int setpriority(pid_t pid, int policy, int value)
+{
+	struct process *p;
+	struct run_queue *rq;
+	bool queued;
+
+	if (policy == SCHED_FAIR && (value < NICE_MIN || value > NICE_MAX))
+		return -1;
+	if (policy == SCHED_FIXED && (value < 0 || value > PRIO_FIXED_MAX))
+		return -1;
+	if (policy != SCHED_FAIR && policy != SCHED_FIXED)
+		return -1;
+	if (pid == 0)
+		pid = running_proc()->pid;
+	for (p = procs; p; p = p->all_next) {
+		spin_lock_acquire(&p->lock);
+		if (p->pid != pid || p->state == PROC_UNUSED) {
+			spin_lock_release(&p->lock);
+			continue;
+		}
+		/*
+		 * A queued process moves to the queue of its new class.  One
+		 * just taken off by a scheduler is not queued any more.
+		 */
+		rq = &cpu_get(p->cpu)->rq;
+		queued = false;
+		if (p->state == PROC_RUNNABLE) {
+			spin_lock_acquire(&rq->lock);
+			if ((queued = sched_class(p)->dequeue(rq, p)))
+				rq->nr--;
+			spin_lock_release(&rq->lock);
+		}
+		p->policy = policy;
+		if (policy == SCHED_FAIR)
+			p->nice = value;
+		else
+			p->prio = value;
+		if (queued)
+			rq_add(p);
+		spin_lock_release(&p->lock);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Copy the memory usage of the process pid, or of the caller if pid
+ * is 0, to the user address addr.
+ */
+int memstat(pid_t pid, uint64_t addr)
+{
+	struct process *p;
+	struct memstat ms;
+
+	if (pid == 0)
+		pid = running_proc()->pid;
+	pm_stat(&ms.total, &ms.free);
+	for (p = procs; p; p = p->all_next) {
+		spin_lock_acquire(&p->lock);
+		if (p->pid == pid && p->state != PROC_UNUSED) {
+			ms.rss = p->rss;
+			ms.kstack = kstack_used(p);
+			spin_lock_release(&p->lock);
+			return copy_out(running_proc()->page_table, addr, &ms,
+					sizeof(ms));
+		}
+		spin_lock_release(&p->lock);
+	}
+	return -1;
+}
+
+/*
+ * Copy the cpu times and switch counts of the process pid, or of the
+ * caller if pid is 0, to the user address addr.
+ */
+int getrusage(pid_t pid, uint64_t addr)
+{
+	struct process *p;
+	struct rusage ru;
+
+	if (pid == 0)
+		pid = running_proc()->pid;
+	for (p = procs; p; p = p->all_next) {
+		spin_lock_acquire(&p->lock);
+		if (p->pid == pid && p->state != PROC_UNUSED) {
+			ru.utime = TO_USEC(p->utime);
+			ru.stime = TO_USEC(p->stime);
+			ru.wtime = TO_USEC(p->wtime);
+			ru.nvcsw = p->nvcsw;
+			ru.nivcsw = p->nivcsw;
+			ru.cutime = TO_USEC(p->cutime);
+			ru.cstime = TO_USEC(p->cstime);
+			ru.cwtime = TO_USEC(p->cwtime);
+			spin_lock_release(&p->lock);
+			return copy_out(running_proc()->page_table, addr, &ru,
+					sizeof(ru));
+		}
+		spin_lock_release(&p->lock);
+	}
+	return -1;
+}
+
+/* Count the times of a reaped child, and its children, to parent. */
+static void add_child_times(struct process *parent, struct process *child)
+{
+	parent->cutime += child->utime + child->cutime;
+	parent->cstime += child->stime + child->cstime;
+	parent->cwtime += child->wtime + child->cwtime;
+}
+
 int wait(uint64_t pstate)
 {
 	struct process *parent, *child;
@@ -354,10 +996,13 @@ int wait(uint64_t pstate)
 	pid_t pid;
 
 	parent = running_proc();
+	/* copy_out() must not fault under wait_lock. */
+	if (pstate && uvm_prefault(pstate, sizeof(parent->xstate), true))
+		return -1;
 	spin_lock_acquire(&wait_lock);
 	while (true) {
 		have_kids = false;
-		for (child = FIRST_PROC; child <= LAST_PROC; child++) {
+		for (child = procs; child; child = child->all_next) {
 			if (child->parent == parent) {
 				have_kids = true;
 				spin_lock_acquire(&child->lock);
@@ -371,6 +1016,7 @@ int wait(uint64_t pstate)
 						spin_lock_release(&wait_lock);
 						return -1;
 					}
+					add_child_times(parent, child);
 					proc_free(child);
 					spin_lock_release(&child->lock);
 					spin_lock_release(&wait_lock);
@@ -383,7 +1029,7 @@ int wait(uint64_t pstate)
 			spin_lock_release(&wait_lock);
 			return -1;
 		}
-		sleep_on(parent, &wait_lock);
+		sleep_on(&parent->child_exit, &wait_lock);
 	}
 }
 
@@ -402,52 +1048,114 @@ void do_exit(int state)
 			p->ofile[fd] = NULL;
 		}
 	}
+	vma_clear(p->page_table, p->vmas);
+
 	begin_op();
 	iput(p->cwd);
 	end_op();
 	p->cwd = NULL;
 
 	spin_lock_acquire(&wait_lock);
-	for (child = FIRST_PROC; child <= LAST_PROC; child++) {
+	for (child = procs; child; child = child->all_next) {
 		if (child->state != PROC_UNUSED && child->parent == p)
 			child->parent = init_proc;
 	}
-	spin_lock_release(&wait_lock);
-	wake_up(init_proc);
+	wake_up(&init_proc->child_exit);
+	wake_up(&p->parent->child_exit);
 
 	spin_lock_acquire(&p->lock);
 	p->xstate = state;
 	p->state = PROC_ZOMBIE;
-	wake_up(p->parent);
+	spin_lock_release(&wait_lock);
 	sched();
 	panic("zombie process");
 }
 
-void sleep_on(void *chan, struct spin_lock *lock)
+void wait_queue_init(struct wait_queue *wq)
+{
+	wq->head = NULL;
+	wq->tail = NULL;
+}
+
+static void wait_queue_del(struct wait_queue *wq, struct process *p)
+{
+	if (p->wait_prev)
+		p->wait_prev->wait_next = p->wait_next;
+	else
+		wq->head = p->wait_next;
+	if (p->wait_next)
+		p->wait_next->wait_prev = p->wait_prev;
+	else
+		wq->tail = p->wait_prev;
+	p->wait = NULL;
+	p->wait_next = NULL;
+	p->wait_prev = NULL;
+}
+
+/*
+ * Sleep on wq until woken, releasing lock meanwhile.  p is queued
+ * before lock is released and p->lock is taken, so a wake_up() under
+ * lock finds p and waits for it to be switched out.
+ */
+void sleep_on(struct wait_queue *wq, struct spin_lock *lock)
 {
 	struct process *p = running_proc();
+
+	if (!spin_lock_holding(lock))
+		panic("sleep without the lock");
+	p->wait = wq;
+	p->wait_next = NULL;
+	p->wait_prev = wq->tail;
+	if (wq->tail)
+		wq->tail->wait_next = p;
+	else
+		wq->head = p;
+	wq->tail = p;
+
 	spin_lock_acquire(&p->lock);
 	spin_lock_release(lock);
-	p->chan = chan;
 	p->state = PROC_SLEEPING;
 	sched();
-	p->chan = NULL;
 	spin_lock_release(&p->lock);
 	spin_lock_acquire(lock);
+	/* kill() wakes p without taking it off the queue. */
+	if (p->wait == wq)
+		wait_queue_del(wq, p);
 }
 
-void wake_up(void *chan)
+/*
+ * Wake the first process on wq that still sleeps.  Ones that kill()
+ * has woken already are taken off on the way, so they do not use up
+ * the wakeup.
+ */
+static bool wake_first(struct wait_queue *wq)
 {
-	struct process *p, *rp;
-	rp = running_proc();
-	for (p = FIRST_PROC; p <= LAST_PROC; p++) {
-		if (p != rp) {
-			spin_lock_acquire(&p->lock);
-			if (p->state == PROC_SLEEPING && p->chan == chan)
-				p->state = PROC_RUNNABLE;
-			spin_lock_release(&p->lock);
-		}
+	struct process *p;
+	bool woken;
+
+	while ((p = wq->head)) {
+		wait_queue_del(wq, p);
+		spin_lock_acquire(&p->lock);
+		if ((woken = p->state == PROC_SLEEPING))
+			rq_add(p);
+		spin_lock_release(&p->lock);
+		if (woken)
+			return true;
 	}
+	return false;
+}
+
+/* Wake every process sleeping on wq. */
+void wake_up(struct wait_queue *wq)
+{
+	while (wake_first(wq))
+		;
+}
+
+/* Wake the process that has slept longest on wq. */
+void wake_up_one(struct wait_queue *wq)
+{
+	wake_first(wq);
 }
 
 static uint8_t initcode[] = {
@@ -470,9 +1178,10 @@ void user_init(void)
 		  PTE_U | PTE_R | PTE_W | PTE_X);
 	memmove(mem, initcode, sizeof(initcode));
 	p->size = PAGE_SIZE;
+	p->rss++;
 	p->tf->epc = 0;
 	p->tf->sp = USER_STACK_TOP;
-	p->state = PROC_RUNNABLE;
+	rq_add(p);
 	p->cwd = namei("/");
 	init_proc = p;
 	strncpy(p->name, "init", sizeof(p->name));
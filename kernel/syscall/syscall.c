@@ -28,6 +28,12 @@ extern uint64_t sys_sbrk(void);
 extern uint64_t sys_shutdown(void);
 extern uint64_t sys_lseek(void);
 extern uint64_t sys_dup2(void);
+extern uint64_t sys_mmap(void);
+extern uint64_t sys_munmap(void);
+extern uint64_t sys_memstat(void);
+extern uint64_t sys_setpriority(void);
+extern uint64_t sys_nanosleep(void);
+extern uint64_t sys_getrusage(void);
 
 static uint64_t (*syscalls[])(void) = {
 	[SYS_brk] = sys_brk,	       [SYS_fork] = sys_fork,
@@ -42,7 +48,10 @@ static uint64_t (*syscalls[])(void) = {
 	[SYS_link] = sys_link,	       [SYS_unlink] = sys_unlink,
 	[SYS_pipe] = sys_pipe,	       [SYS_sbrk] = sys_sbrk,
 	[SYS_shutdown] = sys_shutdown, [SYS_lseek] = sys_lseek,
-	[SYS_dup2] = sys_dup2
+	[SYS_dup2] = sys_dup2,	       [SYS_mmap] = sys_mmap,
+	[SYS_munmap] = sys_munmap,     [SYS_memstat] = sys_memstat,
+	[SYS_setpriority] = sys_setpriority, [SYS_nanosleep] = sys_nanosleep,
+	[SYS_getrusage] = sys_getrusage
 };
 
 #define N_SYSCALL (sizeof(syscalls) / sizeof(syscalls[0]))
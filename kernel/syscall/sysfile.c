@@ -5,6 +5,8 @@
 #include "fs/log.h"
 #include "fs/pipe.h"
 #include "lib/string.h"
+#include "mm/mman.h"
+#include "mm/vma.h"
 #include "printk.h"
 #include "riscv.h"
 #include "sched/cpu.h"
@@ -69,6 +71,7 @@ static struct m_inode *create(char *path, uint16_t type, uint16_t major,
 {
 	struct m_inode *inode, *parent;
 	char name[DIR_SIZE];
+	uint16_t ino;
 
 	parent = parenti(path, name);
 	if (!parent)
@@ -76,10 +79,12 @@ static struct m_inode *create(char *path, uint16_t type, uint16_t major,
 
 	ilock(parent);
 
-	inode = dir_lookup(parent, name, NULL);
-	if (inode) {
+	if ((ino = dir_find(parent, name, NULL))) {
+		inode = iget(parent->dev, ino);
 		iunlock(parent);
 		iput(parent);
+		if (!inode)
+			return NULL;
 		ilock(inode);
 		if (type == FT_FILE &&
 		    (inode->type == FT_FILE || inode->type == FT_DEVICE))
@@ -302,6 +307,7 @@ uint64_t sys_execve(void)
 
 	uargv = ARG(1, uint64_t);
 	memset(argv, 0, sizeof(argv));
+	memset(env, 0, sizeof(env));
 	for (i = 0;; i++) {
 		if (i >= LEN(argv))
 			goto bad;
@@ -319,7 +325,6 @@ uint64_t sys_execve(void)
 	}
 
 	uenv = ARG(2, uint64_t);
-	memset(env, 0, sizeof(env));
 	for (i = 0;; i++) {
 		if (i >= LEN(env))
 			goto bad;
@@ -340,11 +345,15 @@ uint64_t sys_execve(void)
 
 	for (i = 0; i < LEN(argv) && argv[i] != 0; i++)
 		pm_free(argv[i]);
+	for (i = 0; i < LEN(env) && env[i] != 0; i++)
+		pm_free(env[i]);
 	return ret;
 
 bad:
 	for (i = 0; i < LEN(argv) && argv[i] != 0; i++)
 		pm_free(argv[i]);
+	for (i = 0; i < LEN(env) && env[i] != 0; i++)
+		pm_free(env[i]);
 	return -1;
 }
 
@@ -601,3 +610,20 @@ uint64_t sys_dup2(void)
 		}
 	}
 }
+
+uint64_t sys_mmap(void)
+{
+	int flags, fd;
+	struct file *f = NULL;
+
+	/* ARG(0) is only a hint, which is ignored. */
+	flags = ARG(3, int);
+	if (!(flags & MAP_ANONYMOUS)) {
+		fd = arg_fd(4);
+		if (fd < 0)
+			return -1;
+		f = running_proc()->ofile[fd];
+	}
+	return mmap(running_proc(), ARG(1, uint64_t), ARG(2, int), flags, f,
+		    ARG(5, uint32_t));
+}
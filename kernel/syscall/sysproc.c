@@ -1,4 +1,5 @@
 #include "dev/timer.h"
+#include "mm/vma.h"
 #include "sched/cpu.h"
 #include "syscall/syscall.h"
 
@@ -63,6 +64,31 @@ uint64_t sys_sbrk(void)
 		return -1;
 }
 
+uint64_t sys_munmap(void)
+{
+	return munmap(running_proc(), ARG(0, uint64_t), ARG(1, uint64_t));
+}
+
+uint64_t sys_memstat(void)
+{
+	return memstat(ARG(0, pid_t), ARG(1, uint64_t));
+}
+
+uint64_t sys_setpriority(void)
+{
+	return setpriority(ARG(0, pid_t), ARG(1, int), ARG(2, int));
+}
+
+uint64_t sys_nanosleep(void)
+{
+	return timer_nanosleep(ARG(0, uint64_t));
+}
+
+uint64_t sys_getrusage(void)
+{
+	return getrusage(ARG(0, pid_t), ARG(1, uint64_t));
+}
+
 uint64_t sys_shutdown(void)
 {
 	asm volatile("li a7, 8");
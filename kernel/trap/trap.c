@@ -4,6 +4,7 @@
 #include "dev/uart.h"
 #include "dev/virtio_disk.h"
 #include "memlayout.h"
+#include "mm/asid.h"
 #include "printk.h"
 #include "riscv.h"
 #include "sched/cpu.h"
@@ -45,6 +46,20 @@ static void external_intr(void)
 	plic_complete(irq);
 }
 
+/* kernel_trap_vector switches here when a kernel stack overflowed. */
+__attribute__((aligned(16))) uint8_t overflow_stack[PAGE_SIZE * N_CPU];
+
+void kernel_stack_overflow(void)
+{
+	struct process *p = running_proc();
+
+	printk("scause=0x%lx sepc=0x%lx stval=0x%lx\n", read_scause(),
+	       read_sepc(), read_stval());
+	if (p)
+		printk("pid %d %s\n", p->pid, p->name);
+	panic("kernel stack overflow");
+}
+
 void kernel_trap_handler(void)
 {
 	uint64_t sepc = read_sepc();
@@ -65,6 +80,14 @@ void kernel_trap_handler(void)
 			break;
 		case 0x8000000000000009:
 			external_intr();
+			/* A process it woke may outrank the running one. */
+			if (running_proc() && need_resched())
+				yield();
+			break;
+		case 0x8000000000000001: /* from cpu_kick() */
+			write_sip(read_sip() & ~SIE_SSIE);
+			if (running_proc() && need_resched())
+				yield();
 			break;
 		default:
 			printk("scause=0x%lx\n", scause);
@@ -79,11 +102,25 @@ void kernel_trap_handler(void)
 	write_sstatus(sstatus);
 }
 
+/* The PTE permission a page fault asked for. */
+static uint64_t fault_access(uint64_t scause)
+{
+	switch (scause) {
+	case 12:
+		return PTE_X;
+	case 13:
+		return PTE_R;
+	default:
+		return PTE_W;
+	}
+}
+
 void user_trap_handler(void)
 {
 	uint64_t scause = read_scause();
 	uint64_t sstatus = read_sstatus();
 	struct process *p = running_proc();
+	uint64_t now;
 
 	if ((sstatus & SSTATUS_SPP) != 0)
 		panic("the user trap is not from U-mode");
@@ -92,6 +129,11 @@ void user_trap_handler(void)
 
 	p->tf->epc = read_sepc();
 
+	/* The user period ends here, see user_trap_return(). */
+	now = read_time();
+	p->utime += now - p->mark;
+	p->mark = now;
+
 	if ((scause & 0x8000000000000000)) { /* interrupts */
 		switch (scause) {
 		case 0x8000000000000005:
@@ -101,6 +143,9 @@ void user_trap_handler(void)
 		case 0x8000000000000009:
 			external_intr();
 			break;
+		case 0x8000000000000001: /* from cpu_kick(), see below */
+			write_sip(read_sip() & ~SIE_SSIE);
+			break;
 		default:
 			set_killed(p);
 			break;
@@ -114,6 +159,13 @@ void user_trap_handler(void)
 			intr_on();
 			syscall();
 			break;
+		case 12: /* instruction page fault */
+		case 13: /* load page fault */
+		case 15: /* store/AMO page fault */
+			intr_on();
+			if (uvm_fault(p, read_stval(), fault_access(scause)))
+				set_killed(p);
+			break;
 		default:
 			set_killed(p);
 			break;
@@ -123,23 +175,30 @@ void user_trap_handler(void)
 	if (killed(p))
 		do_exit(1);
 
+	if (need_resched())
+		yield();
+
 	user_trap_return();
 }
 
 void user_trap_return(void)
 {
 	struct process *p;
-	uint64_t utvec_va, ret_va, satp, x;
+	uint64_t utvec_va, ret_va, satp, x, now;
 
 	p = running_proc();
 
 	intr_off();
 
+	now = read_time();
+	p->stime += now - p->mark;
+	p->mark = now;
+
 	utvec_va = TRAMPOLINE + (user_trap_vector - trampoline);
 	write_stvec(utvec_va);
 
 	p->tf->kernel_satp = read_satp();
-	p->tf->kernel_sp = p->kernel_stack + PAGE_SIZE;
+	p->tf->kernel_sp = p->kernel_stack + KERNEL_STACK_SIZE;
 	p->tf->kernel_trap = (uint64_t)user_trap_handler;
 	p->tf->kernel_hartid = read_tp();
 
@@ -150,7 +209,7 @@ void user_trap_return(void)
 
 	write_sepc(p->tf->epc);
 
-	satp = MAKE_SATP(p->page_table);
+	satp = asid_satp(p);
 
 	ret_va = TRAMPOLINE + (return_to_user_space - trampoline);
 	/* return_to_user_space(uint64_t user_page_table); */
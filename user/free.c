@@ -0,0 +1,25 @@
+#include "ulib.h"
+
+/* Print memory usage in KiB, and the memory used by processes. */
+int main(int argc, char *argv[])
+{
+	struct memstat ms;
+	int i;
+
+	if (memstat(0, &ms) < 0) {
+		dprintf(2, "%s: memstat failed\n", argv[0]);
+		exit(1);
+	}
+	printf("total %lu KiB, used %lu KiB, free %lu KiB\n", ms.total * 4,
+	       (ms.total - ms.free) * 4, ms.free * 4);
+
+	for (i = 1; i < argc; i++) {
+		if (memstat(atoi(argv[i]), &ms) < 0)
+			dprintf(2, "%s: no process %s\n", argv[0], argv[i]);
+		else
+			printf("pid %s: %lu KiB resident, %lu bytes of "
+			       "kernel stack\n",
+			       argv[i], ms.rss * 4, ms.kstack);
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include "dev/timer.h"
+#include "mm/mman.h"
+#include "ulib.h"
+
+/*
+ * Time the page-table work on a 16 MiB mapping: populating it, forking
+ * a process that shares it, and unmapping it again.  Each step is
+ * printed per page and per last-level page table of 512 pages.
+ *
+ * The heap is populated by faults, one page at a time.  An mmap() with
+ * MAP_POPULATE is populated a page table at a time, and so is every
+ * fork and unmap.
+ */
+
+#define PAGE_SIZE 4096
+#define SIZE (16 * 1024 * 1024)
+#define PAGES (SIZE / PAGE_SIZE)
+#define TABLES (PAGES / 512)
+#define FORKS 8
+
+static void report(const char *what, uint64_t ticks)
+{
+	uint64_t ns = ticks * (1000000000 / TIMER_FREQ);
+
+	printf("mapperf:   %s %lu ns per page, %lu us per page table\n", what,
+	       ns / PAGES, ns / TABLES / 1000);
+}
+
+static void touch(char *p)
+{
+	uint64_t start = rdtime();
+	int i;
+
+	for (i = 0; i < SIZE; i += PAGE_SIZE)
+		p[i] = 1;
+	report("fault in", rdtime() - start);
+}
+
+static void forks(void)
+{
+	uint64_t start = rdtime();
+	int i;
+
+	for (i = 0; i < FORKS; i++) {
+		switch (fork()) {
+		case -1:
+			dprintf(2, "mapperf: fork failed\n");
+			exit(1);
+		case 0:
+			exit(0);
+		}
+		wait(NULL);
+	}
+	report("fork, exit and wait", (rdtime() - start) / FORKS);
+}
+
+int main(void)
+{
+	uint64_t start;
+	char *p;
+
+	printf("mapperf: sbrk %d MiB\n", SIZE >> 20);
+	if ((p = sbrk(SIZE)) == (void *)-1) {
+		dprintf(2, "mapperf: out of memory\n");
+		exit(1);
+	}
+	touch(p);
+	forks();
+	start = rdtime();
+	sbrk(-SIZE);
+	report("unmap", rdtime() - start);
+
+	printf("mapperf: mmap %d MiB with MAP_POPULATE\n", SIZE >> 20);
+	start = rdtime();
+	p = mmap(NULL, SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		dprintf(2, "mapperf: mmap failed\n");
+		exit(1);
+	}
+	report("populate", rdtime() - start);
+	forks();
+	start = rdtime();
+	munmap(p, SIZE);
+	report("unmap", rdtime() - start);
+	return 0;
+}
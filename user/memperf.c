@@ -0,0 +1,103 @@
+#include "fs/fcntl.h"
+#include "ulib.h"
+
+/*
+ * Print the cycles the kernel spends per 4 KiB page to zero a page on
+ * an anonymous fault, to copy one on a copy-on-write fault and to copy
+ * file data out of the buffer cache.  These run page_zero(), page_copy()
+ * and memmove() along with the fault or system call around them.
+ * PAGES is well past the size of the zero pool, so most anonymous
+ * faults zero their page rather than take one zeroed while idle.
+ */
+
+#define PAGE_SIZE 4096
+#define PAGES 1024
+#define FILE_SIZE (64 * 1024)
+#define PASSES 16
+
+static const char *tmp = "memperf.tmp";
+static char block[PAGE_SIZE];
+
+static void report(const char *what, uint64_t cycles, int pages)
+{
+	printf("memperf: %s %lu cycles per 4 KiB\n", what, cycles / pages);
+}
+
+static void zero_faults(void)
+{
+	uint64_t start;
+	char *p;
+	int i;
+
+	if ((p = sbrk(PAGES * PAGE_SIZE)) == (void *)-1) {
+		dprintf(2, "memperf: out of memory\n");
+		exit(1);
+	}
+	start = rdcycle();
+	for (i = 0; i < PAGES; i++)
+		p[i * PAGE_SIZE] = 1;
+	report("zero fault", rdcycle() - start, PAGES);
+}
+
+static void copy_faults(void)
+{
+	uint64_t start;
+	char *p;
+	int i;
+
+	if ((p = sbrk(PAGES * PAGE_SIZE)) == (void *)-1) {
+		dprintf(2, "memperf: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < PAGES; i++)
+		p[i * PAGE_SIZE] = 1;
+
+	switch (fork()) {
+	case -1:
+		dprintf(2, "memperf: fork failed\n");
+		exit(1);
+	case 0:
+		start = rdcycle();
+		for (i = 0; i < PAGES; i++)
+			p[i * PAGE_SIZE] = 2;
+		report("copy-on-write fault", rdcycle() - start, PAGES);
+		exit(0);
+	}
+	wait(NULL);
+}
+
+static void file_reads(void)
+{
+	uint64_t start = 0;
+	int fd, i, pass;
+
+	if ((fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC)) < 0) {
+		dprintf(2, "memperf: cannot create %s\n", tmp);
+		exit(1);
+	}
+	for (i = 0; i < FILE_SIZE / PAGE_SIZE; i++)
+		write(fd, block, PAGE_SIZE);
+	close(fd);
+
+	/* The first pass brings the file into the buffer cache */
+	for (pass = 0; pass <= PASSES; pass++) {
+		if (pass == 1)
+			start = rdcycle();
+		if ((fd = open(tmp, O_RDONLY)) < 0)
+			exit(1);
+		for (i = 0; i < FILE_SIZE / PAGE_SIZE; i++)
+			read(fd, block, PAGE_SIZE);
+		close(fd);
+	}
+	report("cached read", rdcycle() - start,
+	       PASSES * (FILE_SIZE / PAGE_SIZE));
+	unlink(tmp);
+}
+
+int main(void)
+{
+	zero_faults();
+	copy_faults();
+	file_reads();
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include "fs/fcntl.h"
+#include "mm/mman.h"
+#include "ulib.h"
+
+/*
+ * Fill memory until it nearly runs out, then fault in pages that only
+ * reclaim can supply.  The buffer and page caches are warmed first, so
+ * the shrinkers have clean pages to give back.
+ */
+
+#define PAGE_SIZE 4096
+#define FILE_SIZE (512 * 1024) /* Cached by the buffer and page caches */
+#define LOW_WATER 32	       /* Free pages when reclaim must take over */
+#define EXTRA 64	       /* Pages to fault in past LOW_WATER */
+
+static const char *tmp = "memstress.tmp";
+static char block[1024];
+
+static int warm(void)
+{
+	volatile char *p;
+	int fd, i;
+
+	if ((fd = open(tmp, O_CREAT | O_RDWR | O_TRUNC)) < 0)
+		return -1;
+	for (i = 0; i < FILE_SIZE / sizeof(block); i++) {
+		memset(block, i, sizeof(block));
+		if (write(fd, block, sizeof(block)) != sizeof(block)) {
+			close(fd);
+			return -1;
+		}
+	}
+	p = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	for (i = 0; i < FILE_SIZE; i += PAGE_SIZE)
+		(void)p[i];
+	munmap((void *)p, FILE_SIZE);
+	return 0;
+}
+
+static void fill(void)
+{
+	struct memstat ms;
+	uint64_t n = 0, extra = 0;
+	char *p;
+
+	while (extra < EXTRA) {
+		if (memstat(0, &ms) < 0)
+			exit(2);
+		if (ms.free <= LOW_WATER)
+			extra++;
+		if ((p = sbrk(PAGE_SIZE)) == (void *)-1)
+			exit(3);
+		*p = 1;
+		n++;
+	}
+	printf("memstress: faulted in %lu pages, %lu past %d free\n", n,
+	       extra, LOW_WATER);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct memstat before, after;
+	int pid, state;
+
+	if (warm() < 0) {
+		dprintf(2, "memstress: cannot warm the caches\n");
+		exit(1);
+	}
+	memstat(0, &before);
+
+	if ((pid = fork()) < 0) {
+		dprintf(2, "memstress: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0)
+		fill();
+	if (wait(&state) != pid)
+		state = -1;
+
+	memstat(0, &after);
+	unlink(tmp);
+	printf("memstress: %lu free pages before, %lu after\n", before.free,
+	       after.free);
+	if (state != 0) {
+		printf("memstress: FAIL, exit state %d\n", state);
+		exit(1);
+	}
+	printf("memstress: OK\n");
+	return 0;
+}
@@ -0,0 +1,29 @@
+#include "ulib.h"
+
+/* Run a command with a nice value, or a fixed priority with -p. */
+int main(int argc, char *argv[])
+{
+	int policy = SCHED_FAIR, value;
+
+	if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+		policy = SCHED_FIXED;
+		argc--;
+		argv++;
+	}
+	if (argc < 3) {
+		dprintf(2, "usage: nice [-p] value command [arg...]\n");
+		exit(1);
+	}
+
+	if (argv[1][0] == '-')
+		value = -atoi(argv[1] + 1);
+	else
+		value = atoi(argv[1]);
+	if (setpriority(0, policy, value) < 0) {
+		dprintf(2, "nice: bad value %s\n", argv[1]);
+		exit(1);
+	}
+	execvp(argv[2], argv + 2);
+	dprintf(2, "nice: cannot run %s\n", argv[2]);
+	exit(1);
+}
@@ -0,0 +1,88 @@
+#include "dev/timer.h"
+#include "ulib.h"
+
+/*
+ * Bounce a byte between two processes over a pair of pipes and print
+ * the cost of a round trip.  Each side reads a few pages of its own
+ * before passing the byte on, so the time also shows how many of its
+ * TLB entries survive the two switches between address spaces.
+ */
+
+#define PAGE_SIZE 4096
+#define ROUNDS 10000
+#define PAGES 16
+
+static void touch(volatile char *buf, int pages)
+{
+	int i;
+
+	for (i = 0; i < pages; i++)
+		(void)buf[i * PAGE_SIZE];
+}
+
+static void bounce(int in, int out, char *buf, int pages, int rounds,
+		   bool first)
+{
+	char c = 0;
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		if (!first && read(in, &c, 1) != 1)
+			exit(1);
+		touch(buf, pages);
+		if (write(out, &c, 1) != 1)
+			exit(1);
+		if (first && read(in, &c, 1) != 1)
+			exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ping[2], pong[2];
+	int rounds = ROUNDS, pages = PAGES;
+	uint64_t start, ticks;
+	char *buf;
+	pid_t pid;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (argc > 2)
+		pages = atoi(argv[2]);
+	if (rounds <= 0) {
+		dprintf(2, "usage: pingpong [rounds [pages]]\n");
+		exit(1);
+	}
+
+	if ((buf = sbrk(pages * PAGE_SIZE)) == (void *)-1) {
+		dprintf(2, "pingpong: out of memory\n");
+		exit(1);
+	}
+	memset(buf, 1, pages * PAGE_SIZE);
+	if (pipe(ping) < 0 || pipe(pong) < 0) {
+		dprintf(2, "pingpong: pipe failed\n");
+		exit(1);
+	}
+
+	if ((pid = fork()) < 0) {
+		dprintf(2, "pingpong: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		/* Own copies of the pages, not ones shared with the parent */
+		memset(buf, 2, pages * PAGE_SIZE);
+		bounce(ping[0], pong[1], buf, pages, rounds + 1, false);
+		exit(0);
+	}
+
+	/* One round to get both sides running before the clock starts */
+	bounce(pong[0], ping[1], buf, pages, 1, true);
+	start = rdtime();
+	bounce(pong[0], ping[1], buf, pages, rounds, true);
+	ticks = rdtime() - start;
+	wait(NULL);
+
+	printf("pingpong: %d rounds touching %d pages, %lu ns per round trip\n",
+	       rounds, pages, ticks * (1000000000 / TIMER_FREQ) / rounds);
+	return 0;
+}
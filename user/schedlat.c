@@ -0,0 +1,110 @@
+#include "dev/timer.h"
+#include "ulib.h"
+
+/*
+ * Sleep for a millisecond at a time while cpu-bound hogs keep every
+ * hart busy, and print how late the wakeups ran on average and at
+ * worst.  The lateness is the time a woken process waits to be picked.
+ * Unless a number of hogs is given, it is measured with 1, 8, 64 and
+ * 256 hogs in turn, to show whether picking slows as processes grow.
+ * -n runs the hogs at a nice value, and -p runs the sleeper at a fixed
+ * priority, to show how far each class keeps it ahead of the hogs.
+ */
+
+#define MAX_HOGS 256
+#define ROUNDS 200
+#define SLEEP_NS 1000000
+
+static const int sweep[] = { 1, 8, 64, 256 };
+static pid_t pids[MAX_HOGS];
+
+static uint64_t usec(uint64_t ticks)
+{
+	return ticks / (TIMER_FREQ / 1000000);
+}
+
+static int number(const char *s)
+{
+	return s[0] == '-' ? -atoi(s + 1) : atoi(s);
+}
+
+static void hog(int nice)
+{
+	setpriority(0, SCHED_FAIR, nice);
+	for (;;)
+		;
+}
+
+static void measure(int hogs, int rounds, int nice, int prio)
+{
+	uint64_t start, late, total = 0, worst = 0;
+	int i;
+
+	for (i = 0; i < hogs; i++) {
+		if ((pids[i] = fork()) < 0) {
+			dprintf(2, "schedlat: fork failed\n");
+			hogs = i;
+			break;
+		}
+		if (pids[i] == 0)
+			hog(nice);
+	}
+
+	for (i = 0; i < rounds; i++) {
+		start = rdtime();
+		nanosleep(SLEEP_NS);
+		late = rdtime() - start - SLEEP_NS / (1000000000 / TIMER_FREQ);
+		total += late;
+		if (late > worst)
+			worst = late;
+	}
+
+	for (i = 0; i < hogs; i++)
+		kill(pids[i]);
+	for (i = 0; i < hogs; i++)
+		wait(NULL);
+
+	printf("schedlat: %d hogs at nice %d, ", hogs, nice);
+	if (prio >= 0)
+		printf("priority %d, ", prio);
+	printf("wakeup late by %lu us on average, %lu us at worst\n",
+	       usec(total / rounds), usec(worst));
+}
+
+int main(int argc, char *argv[])
+{
+	int hogs = 0, rounds = ROUNDS, nice = 0, prio = -1, i;
+
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-n") == 0)
+			nice = number(argv[2]);
+		else if (strcmp(argv[1], "-p") == 0)
+			prio = atoi(argv[2]);
+		else
+			break;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 1)
+		hogs = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (hogs > MAX_HOGS || rounds <= 0 || nice < NICE_MIN ||
+	    nice > NICE_MAX || prio > PRIO_FIXED_MAX) {
+		dprintf(2, "usage: schedlat [-n nice] [-p prio] "
+			   "[hogs [rounds]]\n");
+		exit(1);
+	}
+	if (prio >= 0 && setpriority(0, SCHED_FIXED, prio) < 0) {
+		dprintf(2, "schedlat: cannot set priority %d\n", prio);
+		prio = -1;
+	}
+
+	if (hogs > 0) {
+		measure(hogs, rounds, nice, prio);
+		return 0;
+	}
+	for (i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++)
+		measure(sweep[i], rounds, nice, prio);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#include "ulib.h"
+
+/* Run a command and print the cpu time it and its children used. */
+int main(int argc, char *argv[])
+{
+	struct rusage before, after;
+	pid_t pid;
+
+	if (argc < 2) {
+		dprintf(2, "usage: time command [arg...]\n");
+		exit(1);
+	}
+	if (getrusage(0, &before) < 0) {
+		dprintf(2, "time: getrusage failed\n");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		dprintf(2, "time: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		dprintf(2, "time: cannot run %s\n", argv[1]);
+		exit(1);
+	}
+	wait(NULL);
+
+	getrusage(0, &after);
+	printf("user %lu us, sys %lu us, wait %lu us\n",
+	       after.cutime - before.cutime, after.cstime - before.cstime,
+	       after.cwtime - before.cwtime);
+	return 0;
+}
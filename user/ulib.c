@@ -541,3 +541,19 @@ int execvp(const char *name, char *const *argv)
 		return -1;
 	}
 }
+
+/* Ticks of the timebase, TIMER_FREQ per second */
+uint64_t rdtime(void)
+{
+	uint64_t v;
+	asm volatile("rdtime %0" : "=r"(v));
+	return v;
+}
+
+/* Cycles of this hart */
+uint64_t rdcycle(void)
+{
+	uint64_t v;
+	asm volatile("rdcycle %0" : "=r"(v));
+	return v;
+}
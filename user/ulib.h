@@ -2,6 +2,9 @@
 #define _ULIB_H
 
 #include "fs/stat.h"
+#include "mm/memstat.h"
+#include "sched/policy.h"
+#include "sched/rusage.h"
 
 extern char **environ;
 
@@ -10,6 +13,7 @@ pid_t fork(void);
 pid_t wait(int *pstate);
 void exit(int state) __attribute__((noreturn));
 void sleep(uint64_t ticks);
+int nanosleep(uint64_t ns);
 int kill(pid_t pid);
 pid_t getpid(void);
 ssize_t read(int fd, void *buf, size_t n);
@@ -30,6 +34,12 @@ int unlink(const char *name);
 void shutdown(void) __attribute__((noreturn));
 off_t lseek(int fd, off_t offset, int whence);
 int dup2(int oldfd, int newfd);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+	   off_t offset);
+int munmap(void *addr, size_t length);
+int memstat(pid_t pid, struct memstat *ms);
+int setpriority(pid_t pid, int policy, int value);
+int getrusage(pid_t pid, struct rusage *ru);
 int stat(const char *name, struct stat *st);
 int execvp(const char *name, char *const *argv);
 char *getcwd(char *buf, size_t max_len);
@@ -61,6 +71,9 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 int atoi(const char *nptr);
 
+uint64_t rdtime(void);
+uint64_t rdcycle(void);
+
 void *malloc(size_t size);
 void free(void *ptr);
 